@@ -2,14 +2,21 @@ module PolarSSL
   class Cipher
     class << self
       attr_reader :ciphers
+      # AES ECB/CTR/GCM inputs of at least this many bytes are split across
+      # the worker threads (see PolarSSL.worker_threads). nil keeps them on
+      # the calling thread.
+      attr_accessor :parallel_threshold
     end
 
     @ciphers = [
       "DES-CBC",
       "DES-ECB",
       "DES3-CBC",
-      "DES3-ECB"
-    ]
+      "DES3-ECB",
+      "AES-ECB",
+      "AES-CTR",
+      "AES-GCM"
+    ].select { |c| PolarSSL::FEATURES.include?(c.start_with?("AES") ? "aes" : "des") }
 
     attr_accessor :padding, :key, :source, :bkey, :bsource, :iv, :biv
     attr_reader :length, :algorithm, :name, :mode, :final, :cipher, :type
@@ -0,0 +1,15 @@
+if PolarSSL::FEATURES.include?("aes")
+  module PolarSSL
+    class Cipher
+      class AES
+        def initialize(algorithm)
+          super("#{self.name}-#{algorithm}")
+        end
+
+        def name
+          "AES"
+        end
+      end
+    end
+  end
+end
@@ -1,5 +1,5 @@
 module PolarSSL
   class CtrDrbg
-    attr_reader :pers
+    attr_reader :pers, :entropy
   end
 end
@@ -0,0 +1,26 @@
+module PolarSSL
+  class Entropy
+    class << self
+      # Seed file used by every Entropy.new, including the ones made
+      # internally (PKey.rng, PKey::EC, SSL::Pool). nil disables it.
+      attr_accessor :seed_file
+
+      def new(*args)
+        entropy = super
+        entropy.use_seed_file(seed_file) if seed_file && entropy.respond_to?(:load_seed_file)
+        entropy
+      end
+    end
+
+    # Loads path as a strong source, or creates it on the first run. An
+    # empty file is one another Entropy has loaded and not refilled yet.
+    def use_seed_file(path)
+      if File.exist?(path) && File.size(path) > 0
+        load_seed_file(path, true)
+      else
+        write_seed_file(path)
+      end
+      self
+    end
+  end
+end
@@ -1,60 +1,95 @@
 module PolarSSL
   module PKey
-    class EC
-      POLARSSL_ECP_DP_NONE      = 0
-      POLARSSL_ECP_DP_SECP192R1 = 1  # 192-bits NIST curve
-      POLARSSL_ECP_DP_SECP224R1 = 2  # 224-bits NIST curve
-      POLARSSL_ECP_DP_SECP256R1 = 3  # 256-bits NIST curve
-      POLARSSL_ECP_DP_SECP384R1 = 4  # 384-bits NIST curve
-      POLARSSL_ECP_DP_SECP521R1 = 5  # 521-bits NIST curve
-      POLARSSL_ECP_DP_BP256R1   = 6  # 256-bits Brainpool curve
-      POLARSSL_ECP_DP_BP384R1   = 7  # 384-bits Brainpool curve
-      POLARSSL_ECP_DP_BP512R1   = 8  # 512-bits Brainpool curve
-      POLARSSL_ECP_DP_M221      = 8  # (not implemented yet)
-      POLARSSL_ECP_DP_M255      = 9  # Curve25519
-      POLARSSL_ECP_DP_M383      = 10 # (not implemented yet)
-      POLARSSL_ECP_DP_M511      = 11 # (not implemented yet)
-      POLARSSL_ECP_DP_SECP192K1 = 12 # (not implemented yet)
-      POLARSSL_ECP_DP_SECP224K1 = 13 # (not implemented yet)
-      POLARSSL_ECP_DP_SECP256K1 = 14 # 256-bits Koblitz curve
-
-      CURVES = {
-        "none"      => POLARSSL_ECP_DP_NONE,
-        "secp192r1" => POLARSSL_ECP_DP_SECP192R1,
-        "secp224r1" => POLARSSL_ECP_DP_SECP224R1,
-        "secp256r1" => POLARSSL_ECP_DP_SECP256R1,
-        "secp384r1" => POLARSSL_ECP_DP_SECP384R1,
-        "secp521r1" => POLARSSL_ECP_DP_SECP521R1,
-        "bp256r1"   => POLARSSL_ECP_DP_BP256R1,
-        "bp384r1"   => POLARSSL_ECP_DP_BP384R1,
-        "bp512r1"   => POLARSSL_ECP_DP_BP512R1,
-        "m221"      => POLARSSL_ECP_DP_M221,
-        "m255"      => POLARSSL_ECP_DP_M255,
-        "m383"      => POLARSSL_ECP_DP_M383,
-        "m511"      => POLARSSL_ECP_DP_M511,
-        "secp192k1" => POLARSSL_ECP_DP_SECP192K1,
-        "secp224k1" => POLARSSL_ECP_DP_SECP224K1,
-        "secp256k1" => POLARSSL_ECP_DP_SECP256K1,
-      }
-
-      attr_reader :curve, :curve_id, :entropy, :ctr_drbg, :pem
-
-      def initialize(pem_or_curve = "secp256k1")
-        alloc
-        @entropy = PolarSSL::Entropy.new
-        @ctr_drbg = PolarSSL::CtrDrbg.new(entropy, "ecdsa")
-        check_pem(pem_or_curve)
+    class Error < StandardError; end
+
+    # Shared generator for key parsing, signing and key agreement.
+    def self.rng
+      @rng ||= PolarSSL::CtrDrbg.new(PolarSSL::Entropy.new, "pkey")
+    end
+
+    if PolarSSL::FEATURES.include?("ecdh")
+      class ECDH
+        attr_reader :curve
+
+        # ECDH.generate("secp256r1") => new key pair
+        def self.generate(curve = "x25519")
+          new(curve).generate
+        end
+      end
+    end
+
+    if PolarSSL::FEATURES.include?("pkey")
+      # Parse a PEM or DER key once and reuse it for sign/verify or as
+      # SSL.new(client_key:).
+      def self.read(data, password = nil)
+        PKey.new(data, password)
       end
 
-      def check_pem(pem_or_curve)
-        @curve_id = CURVES[pem_or_curve]
-        unless @curve_id
-          load_pem(pem_or_curve)
-        else
-          @curve = pem_or_curve
+      class PKey
+        def private?; @private; end
+
+        def inspect
+          "#<#{self.class}: #{type} #{bits} bits#{private? ? ' private' : ''}>"
+        end
+      end
+    end
+
+    if PolarSSL::FEATURES.include?("ecdsa")
+      class EC
+        POLARSSL_ECP_DP_NONE      = 0
+        POLARSSL_ECP_DP_SECP192R1 = 1  # 192-bits NIST curve
+        POLARSSL_ECP_DP_SECP224R1 = 2  # 224-bits NIST curve
+        POLARSSL_ECP_DP_SECP256R1 = 3  # 256-bits NIST curve
+        POLARSSL_ECP_DP_SECP384R1 = 4  # 384-bits NIST curve
+        POLARSSL_ECP_DP_SECP521R1 = 5  # 521-bits NIST curve
+        POLARSSL_ECP_DP_BP256R1   = 6  # 256-bits Brainpool curve
+        POLARSSL_ECP_DP_BP384R1   = 7  # 384-bits Brainpool curve
+        POLARSSL_ECP_DP_BP512R1   = 8  # 512-bits Brainpool curve
+        POLARSSL_ECP_DP_M221      = 8  # (not implemented yet)
+        POLARSSL_ECP_DP_M255      = 9  # Curve25519
+        POLARSSL_ECP_DP_M383      = 10 # (not implemented yet)
+        POLARSSL_ECP_DP_M511      = 11 # (not implemented yet)
+        POLARSSL_ECP_DP_SECP192K1 = 12 # (not implemented yet)
+        POLARSSL_ECP_DP_SECP224K1 = 13 # (not implemented yet)
+        POLARSSL_ECP_DP_SECP256K1 = 14 # 256-bits Koblitz curve
+
+        CURVES = {
+          "none"      => POLARSSL_ECP_DP_NONE,
+          "secp192r1" => POLARSSL_ECP_DP_SECP192R1,
+          "secp224r1" => POLARSSL_ECP_DP_SECP224R1,
+          "secp256r1" => POLARSSL_ECP_DP_SECP256R1,
+          "secp384r1" => POLARSSL_ECP_DP_SECP384R1,
+          "secp521r1" => POLARSSL_ECP_DP_SECP521R1,
+          "bp256r1"   => POLARSSL_ECP_DP_BP256R1,
+          "bp384r1"   => POLARSSL_ECP_DP_BP384R1,
+          "bp512r1"   => POLARSSL_ECP_DP_BP512R1,
+          "m221"      => POLARSSL_ECP_DP_M221,
+          "m255"      => POLARSSL_ECP_DP_M255,
+          "m383"      => POLARSSL_ECP_DP_M383,
+          "m511"      => POLARSSL_ECP_DP_M511,
+          "secp192k1" => POLARSSL_ECP_DP_SECP192K1,
+          "secp224k1" => POLARSSL_ECP_DP_SECP224K1,
+          "secp256k1" => POLARSSL_ECP_DP_SECP256K1,
+        }
+
+        attr_reader :curve, :curve_id, :entropy, :ctr_drbg, :pem
+
+        def initialize(pem_or_curve = "secp256k1")
+          alloc
+          @ctr_drbg = PKey.rng
+          @entropy = @ctr_drbg.entropy
+          check_pem(pem_or_curve)
+        end
+
+        def check_pem(pem_or_curve)
+          @curve_id = CURVES[pem_or_curve]
+          unless @curve_id
+            load_pem(pem_or_curve)
+          else
+            @curve = pem_or_curve
+          end
         end
       end
     end
   end
 end
-
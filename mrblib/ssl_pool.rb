@@ -0,0 +1,128 @@
+module PolarSSL
+  class SSL
+    # Keeps established connections around for reuse, keyed by host, port
+    # and the options given to SSL.new.
+    #
+    #   pool = PolarSSL::SSL::Pool.new(max_idle: 4, idle_timeout: 30)
+    #   pool.with('tls.mbed.org', 443) do |ssl|
+    #     ssl.write("GET / HTTP/1.1\r\nHost: tls.mbed.org\r\n\r\n")
+    #     ssl.read_until("\r\n\r\n")
+    #   end
+    class Pool
+      attr_reader :max_idle, :idle_timeout
+
+      # max_idle:     idle connections kept per key
+      # idle_timeout: seconds an idle connection may be reused for
+      # authmode:     passed to SSL#set_authmode when given
+      # A block replaces the default connection setup; it receives
+      # host, port and options and must return a handshaked SSL.
+      def initialize(max_idle: 4, idle_timeout: 60, authmode: nil, &connector)
+        @max_idle = max_idle
+        @idle_timeout = idle_timeout
+        @authmode = authmode
+        @connector = connector
+        @idle = {}
+        @keys = {}
+      end
+
+      def checkout(host, port, options = {})
+        key = pool_key(host, port, options)
+        list = @idle[key]
+        now = Time.now.to_f
+        while list && (entry = list.pop)
+          ssl, since = entry
+          return track(ssl, key) if now - since <= @idle_timeout && ssl.alive?
+          discard(ssl)
+        end
+        track(connect(host, port, options), key)
+      end
+
+      def release(ssl)
+        key = @keys.delete(ssl.object_id)
+        list = key && (@idle[key] ||= [])
+        if list && list.size < @max_idle && ssl.alive?
+          list.push [ssl, Time.now.to_f]
+        else
+          discard(ssl)
+        end
+        nil
+      end
+
+      def with(host, port, options = {})
+        ssl = checkout(host, port, options)
+        begin
+          result = yield ssl
+        rescue Exception
+          @keys.delete(ssl.object_id)
+          discard(ssl)
+          raise
+        end
+        release(ssl)
+        result
+      end
+
+      def idle_count
+        @idle.values.inject(0) { |sum, list| sum + list.size }
+      end
+
+      def clear
+        @idle.each_value { |list| list.each { |ssl, _| discard(ssl) } }
+        @idle.clear
+        nil
+      end
+
+      private
+
+      def track(ssl, key)
+        @keys[ssl.object_id] = key
+        ssl
+      end
+
+      # Strings and Arrays compare by content (copied, so later changes by
+      # the caller don't move the entry), CAChain and cache objects by
+      # identity.
+      def pool_key(host, port, options)
+        key = [host.to_s, port.to_i]
+        options.keys.sort.each do |name|
+          value = options[name]
+          value = value.dup if value.is_a?(String) || value.is_a?(Array)
+          key << name << value
+        end
+        key
+      end
+
+      def rng
+        @rng ||= PolarSSL::CtrDrbg.new(PolarSSL::Entropy.new)
+      end
+
+      def connect(host, port, options)
+        return @connector.call(host, port, options) if @connector
+
+        socket = TCPSocket.new(host, port)
+        begin
+          ssl = PolarSSL::SSL.new(**options)
+          ssl.set_endpoint(PolarSSL::SSL::SSL_IS_CLIENT)
+          ssl.set_authmode(@authmode) if @authmode
+          ssl.set_rng(rng)
+          ssl.set_hostname(host)
+          ssl.set_socket(socket)
+          ssl.handshake
+          ssl
+        rescue Exception
+          socket.close
+          raise
+        end
+      end
+
+      def discard(ssl)
+        begin
+          # a dead peer would only get us an error (or SIGPIPE)
+          ssl.close_notify if !ssl.eof? && ssl.alive?
+        rescue StandardError
+        end
+        ssl.socket.close if ssl.socket && !ssl.socket.closed?
+        ssl.close
+      end
+    end
+  end
+end
@@ -0,0 +1,13 @@
+/*
+ * Added to whichever mbedtls configuration is in use as
+ * MBEDTLS_USER_CONFIG_FILE when polarssl_allocator is enabled (see
+ * mrbgem.rake), so the gem can install its allocator (src/allocator.c).
+ */
+#ifndef MRUBY_POLARSSL_PROFILE_ALLOCATOR_H
+#define MRUBY_POLARSSL_PROFILE_ALLOCATOR_H
+
+#ifndef MBEDTLS_PLATFORM_MEMORY
+#define MBEDTLS_PLATFORM_MEMORY
+#endif
+
+#endif
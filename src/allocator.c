@@ -0,0 +1,213 @@
+#include "allocator.h"
+
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+
+#include <stdlib.h>
+#include <string.h>
+#include "mbedtls/platform.h"
+#include "worker_pool.h"
+
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+#include <pthread.h>
+// only the block cache is locked, the counters are atomics
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+#define MEM_LOCK()   pthread_mutex_lock(&mem_lock)
+#define MEM_UNLOCK() pthread_mutex_unlock(&mem_lock)
+#define MEM_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+#define MEM_SUB(p, n) __atomic_sub_fetch((p), (n), __ATOMIC_RELAXED)
+#define MEM_GET(p)    __atomic_load_n((p), __ATOMIC_RELAXED)
+#define MEM_SET(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define MEM_CAS(p, expected, desired) \
+  __atomic_compare_exchange_n((p), (expected), (desired), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define MEM_LOCK()
+#define MEM_UNLOCK()
+#define MEM_ADD(p, n) (*(p) += (n))
+#define MEM_SUB(p, n) (*(p) -= (n))
+#define MEM_GET(p)    (*(p))
+#define MEM_SET(p, v) (*(p) = (v))
+#define MEM_CAS(p, expected, desired) (*(p) = (desired), 1)
+#endif
+
+#if defined(_MSC_VER)
+#define MEM_THREAD_LOCAL __declspec(thread)
+#else
+#define MEM_THREAD_LOCAL __thread
+#endif
+
+/*
+ * Size classes: small ones cover bignum limbs and ASN.1 pieces, the last
+ * one a TLS record buffer (16k payload plus header, IV, MAC and padding).
+ */
+static const size_t mem_classes[] = { 64, 256, 1024, 4096, 17408 };
+#define MEM_CLASSES (sizeof(mem_classes) / sizeof(mem_classes[0]))
+#define MEM_CACHE_MAX 32
+#define MEM_NO_CLASS ((size_t) -1)
+
+typedef union mem_header {
+  struct {
+    mrb_polarssl_mem_owner *owner;
+    size_t size;
+    size_t cls;
+  } h;
+  union mem_header *next;  // while cached
+  long double align;
+} mem_header;
+
+static mem_header *mem_cache[MEM_CLASSES];
+static size_t mem_cache_len[MEM_CLASSES];
+static mrb_polarssl_mem_stats mem_stats;
+static int mem_pooling = 0;
+static int mem_installed = 0;
+static MEM_THREAD_LOCAL mrb_polarssl_mem_owner *mem_scope = NULL;
+
+static void mem_raise_peak(size_t *peak, size_t current) {
+  size_t seen = MEM_GET(peak);
+
+  while (current > seen && !MEM_CAS(peak, &seen, current))
+    ;
+}
+
+static size_t mem_class_for(size_t size) {
+  size_t i;
+
+  for (i = 0; i < MEM_CLASSES; i++) {
+    if (size <= mem_classes[i]) return i;
+  }
+  return MEM_NO_CLASS;
+}
+
+static void *mem_calloc(size_t n, size_t size) {
+  mem_header *hdr = NULL;
+  size_t total, cls;
+
+  if (size != 0 && n > ((size_t) -1 - sizeof(mem_header)) / size)
+    return NULL;
+  total = n * size;
+  cls = MEM_GET(&mem_pooling) ? mem_class_for(total) : MEM_NO_CLASS;
+
+  if (cls != MEM_NO_CLASS) {
+    MEM_LOCK();
+    if (mem_cache[cls]) {
+      hdr = mem_cache[cls];
+      mem_cache[cls] = hdr->next;
+      mem_cache_len[cls]--;
+      MEM_SUB(&mem_stats.cached, mem_classes[cls]);
+    }
+    MEM_UNLOCK();
+  }
+
+  if (hdr == NULL) {
+    hdr = malloc(sizeof(mem_header) + (cls == MEM_NO_CLASS ? total : mem_classes[cls]));
+    if (hdr == NULL) return NULL;
+  }
+  memset(hdr + 1, 0, total);
+  hdr->h.owner = mem_scope;
+  hdr->h.size = total;
+  hdr->h.cls = cls;
+
+  mem_raise_peak(&mem_stats.peak, MEM_ADD(&mem_stats.current, total));
+  MEM_ADD(&mem_stats.allocations, 1);
+  if (hdr->h.owner) {
+    MEM_ADD(&hdr->h.owner->refs, 1);
+    mem_raise_peak(&hdr->h.owner->peak, MEM_ADD(&hdr->h.owner->current, total));
+  }
+  return hdr + 1;
+}
+
+static void mem_free(void *ptr) {
+  mem_header *hdr;
+  mrb_polarssl_mem_owner *owner, *dead = NULL;
+  size_t cls;
+
+  if (ptr == NULL) return;
+  hdr = (mem_header *) ptr - 1;
+  owner = hdr->h.owner;
+  cls = hdr->h.cls;
+
+  MEM_SUB(&mem_stats.current, hdr->h.size);
+  if (owner) {
+    MEM_SUB(&owner->current, hdr->h.size);
+    if (MEM_SUB(&owner->refs, 1) == 0) dead = owner;
+  }
+  if (cls != MEM_NO_CLASS && MEM_GET(&mem_pooling)) {
+    MEM_LOCK();
+    if (mem_pooling && mem_cache_len[cls] < MEM_CACHE_MAX) {
+      hdr->next = mem_cache[cls];
+      mem_cache[cls] = hdr;
+      mem_cache_len[cls]++;
+      MEM_ADD(&mem_stats.cached, mem_classes[cls]);
+      hdr = NULL;
+    }
+    MEM_UNLOCK();
+  }
+
+  free(hdr);
+  free(dead);
+}
+
+void mrb_polarssl_mem_install(void) {
+  MEM_LOCK();
+  if (!mem_installed) {
+    mbedtls_platform_set_calloc_free(mem_calloc, mem_free);
+    mem_installed = 1;
+  }
+  MEM_UNLOCK();
+}
+
+void mrb_polarssl_mem_set_pooling(int enabled) {
+  mem_header *hdr;
+  size_t i;
+
+  MEM_LOCK();
+  MEM_SET(&mem_pooling, enabled);
+  if (!enabled) {
+    for (i = 0; i < MEM_CLASSES; i++) {
+      while ((hdr = mem_cache[i]) != NULL) {
+        mem_cache[i] = hdr->next;
+        free(hdr);
+      }
+      mem_cache_len[i] = 0;
+    }
+    MEM_SET(&mem_stats.cached, 0);
+  }
+  MEM_UNLOCK();
+}
+
+int mrb_polarssl_mem_pooling(void) {
+  return MEM_GET(&mem_pooling);
+}
+
+void mrb_polarssl_mem_get_stats(mrb_polarssl_mem_stats *stats) {
+  stats->current = MEM_GET(&mem_stats.current);
+  stats->peak = MEM_GET(&mem_stats.peak);
+  stats->allocations = MEM_GET(&mem_stats.allocations);
+  stats->cached = MEM_GET(&mem_stats.cached);
+}
+
+mrb_polarssl_mem_owner *mrb_polarssl_mem_owner_new(void) {
+  mrb_polarssl_mem_owner *owner = calloc(1, sizeof(mrb_polarssl_mem_owner));
+
+  if (owner) owner->refs = 1;
+  return owner;
+}
+
+void mrb_polarssl_mem_owner_release(mrb_polarssl_mem_owner *owner) {
+  if (owner == NULL) return;
+  if (mem_scope == owner) mem_scope = NULL;
+  if (MEM_SUB(&owner->refs, 1) == 0) free(owner);
+}
+
+size_t mrb_polarssl_mem_owner_usage(mrb_polarssl_mem_owner *owner, size_t *peak) {
+  if (peak) *peak = MEM_GET(&owner->peak);
+  return MEM_GET(&owner->current);
+}
+
+mrb_polarssl_mem_owner *mrb_polarssl_mem_enter(mrb_polarssl_mem_owner *owner) {
+  mrb_polarssl_mem_owner *prev = mem_scope;
+
+  mem_scope = owner;
+  return prev;
+}
+
+#endif
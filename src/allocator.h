@@ -0,0 +1,59 @@
+#ifndef MRUBY_POLARSSL_ALLOCATOR_H
+#define MRUBY_POLARSSL_ALLOCATOR_H
+
+/*
+ * Allocator installed through mbedtls_platform_set_calloc_free. It keeps
+ * global and per owner (one per SSL object) byte counts and can recycle
+ * blocks of the common record buffer and bignum sizes.
+ * Opt-in: polarssl_allocator in mrbgem.rake defines MRUBY_POLARSSL_USE_ALLOCATOR
+ * and turns on MBEDTLS_PLATFORM_MEMORY.
+ */
+
+#include <stddef.h>
+#include "mbedtls/build_info.h"
+
+#if defined(MBEDTLS_PLATFORM_MEMORY) && defined(MRUBY_POLARSSL_USE_ALLOCATOR)
+#define MRUBY_POLARSSL_ALLOCATOR 1
+#endif
+
+typedef struct mrb_polarssl_mem_owner {
+  size_t current;
+  size_t peak;
+  size_t refs;  // live allocations + 1 for the owning object
+} mrb_polarssl_mem_owner;
+
+typedef struct mrb_polarssl_mem_stats {
+  size_t current;
+  size_t peak;
+  size_t allocations;
+  size_t cached;
+} mrb_polarssl_mem_stats;
+
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+void mrb_polarssl_mem_install(void);
+void mrb_polarssl_mem_set_pooling(int enabled);
+int mrb_polarssl_mem_pooling(void);
+void mrb_polarssl_mem_get_stats(mrb_polarssl_mem_stats *stats);
+
+mrb_polarssl_mem_owner *mrb_polarssl_mem_owner_new(void);
+void mrb_polarssl_mem_owner_release(mrb_polarssl_mem_owner *owner);
+size_t mrb_polarssl_mem_owner_usage(mrb_polarssl_mem_owner *owner, size_t *peak);
+// Attributes the calling thread's mbedtls allocations to owner (NULL for
+// none) and returns the previous owner, to be restored afterwards. Nothing
+// inside a scope may raise: callbacks that run Ruby code from within
+// mbedtls leave the scope first (MRB_POLARSSL_MEM_LEAVE), so a raise out
+// of them finds it already reset.
+mrb_polarssl_mem_owner *mrb_polarssl_mem_enter(mrb_polarssl_mem_owner *owner);
+
+#define MRB_POLARSSL_MEM_SCOPE(owner, stmt) do { \
+  mrb_polarssl_mem_owner *mem_prev_ = mrb_polarssl_mem_enter(owner); \
+  stmt; \
+  mrb_polarssl_mem_enter(mem_prev_); \
+} while (0)
+#define MRB_POLARSSL_MEM_LEAVE(stmt) MRB_POLARSSL_MEM_SCOPE(NULL, stmt)
+#else
+#define MRB_POLARSSL_MEM_SCOPE(owner, stmt) do { stmt; } while (0)
+#define MRB_POLARSSL_MEM_LEAVE(stmt) do { stmt; } while (0)
+#endif
+
+#endif
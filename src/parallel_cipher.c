@@ -0,0 +1,378 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+#include "worker_pool.h"
+#include "parallel_cipher.h"
+
+#if defined(MBEDTLS_AES_C)
+
+/*
+ * The bulk work is mbedtls_aes_crypt_ctr and mbedtls_gcm, so its AESNI,
+ * PCLMUL and AESCE paths apply. Only folding the chunks' GHASH values
+ * together is done here: a handful of GF(2^128) multiplications per call,
+ * with 4-bit tables laid out like mbedtls' gcm.c.
+ */
+typedef struct ghash_table {
+  uint64_t HL[16];
+  uint64_t HH[16];
+} ghash_table;
+
+static const uint64_t last4[16] = {
+  0x0000, 0x1c20, 0x3840, 0x2460,
+  0x7080, 0x6ca0, 0x48c0, 0x54e0,
+  0xe100, 0xfd20, 0xd940, 0xc560,
+  0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static uint64_t get_be64(const unsigned char *b) {
+  uint64_t v = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    v = (v << 8) | b[i];
+  return v;
+}
+
+static void put_be64(unsigned char *b, uint64_t v) {
+  int i;
+
+  for (i = 7; i >= 0; i--) {
+    b[i] = (unsigned char) v;
+    v >>= 8;
+  }
+}
+
+static void ghash_init(ghash_table *t, const unsigned char h[16]) {
+  uint64_t vh = get_be64(h), vl = get_be64(h + 8);
+  int i, j;
+
+  t->HH[0] = 0;
+  t->HL[0] = 0;
+  t->HH[8] = vh;
+  t->HL[8] = vl;
+  for (i = 4; i > 0; i >>= 1) {
+    uint64_t T = (vl & 1) * 0xe1000000U;
+    vl = (vh << 63) | (vl >> 1);
+    vh = (vh >> 1) ^ (T << 32);
+    t->HL[i] = vl;
+    t->HH[i] = vh;
+  }
+  for (i = 2; i <= 8; i *= 2) {
+    vh = t->HH[i];
+    vl = t->HL[i];
+    for (j = 1; j < i; j++) {
+      t->HH[i + j] = vh ^ t->HH[j];
+      t->HL[i + j] = vl ^ t->HL[j];
+    }
+  }
+}
+
+// out = x * H; out may alias x
+static void ghash_mult(const ghash_table *t, const unsigned char x[16], unsigned char out[16]) {
+  unsigned char lo, hi, rem;
+  uint64_t zh, zl;
+  int i;
+
+  lo = x[15] & 0xf;
+  zh = t->HH[lo];
+  zl = t->HL[lo];
+  for (i = 15; i >= 0; i--) {
+    lo = x[i] & 0xf;
+    hi = (x[i] >> 4) & 0xf;
+    if (i != 15) {
+      rem = (unsigned char) zl & 0xf;
+      zl = (zh << 60) | (zl >> 4);
+      zh = (zh >> 4) ^ (last4[rem] << 48);
+      zh ^= t->HH[lo];
+      zl ^= t->HL[lo];
+    }
+    rem = (unsigned char) zl & 0xf;
+    zl = (zh << 60) | (zl >> 4);
+    zh = (zh >> 4) ^ (last4[rem] << 48);
+    zh ^= t->HH[hi];
+    zl ^= t->HL[hi];
+  }
+  put_be64(out, zh);
+  put_be64(out + 8, zl);
+}
+
+// out = a * b in GF(2^128); out may alias either operand
+static void gf_mult(const unsigned char a[16], const unsigned char b[16], unsigned char out[16]) {
+  ghash_table t;
+
+  ghash_init(&t, b);
+  ghash_mult(&t, a, out);
+}
+
+// out = h^n
+static void gf_pow(const unsigned char h[16], size_t n, unsigned char out[16]) {
+  unsigned char base[16];
+
+  memcpy(base, h, 16);
+  memset(out, 0, 16);
+  out[0] = 0x80;  // the field's 1 in GCM bit order
+  while (n > 0) {
+    if (n & 1)
+      gf_mult(out, base, out);
+    gf_mult(base, base, base);
+    n >>= 1;
+  }
+}
+
+
+// CTR counter blocks are incremented as a whole. GCM only carries within
+// the low 32 bits, which never wrap for a 12 byte IV (counters start at 2
+// and GCM caps a message at 2^32 - 2 blocks), so the same addition works.
+static void ctr_add(unsigned char ctr[16], uint64_t n) {
+  uint64_t carry = n;
+  int i;
+
+  for (i = 15; i >= 0 && carry > 0; i--) {
+    carry += ctr[i];
+    ctr[i] = (unsigned char) carry;
+    carry >>= 8;
+  }
+}
+
+typedef struct par_job {
+  enum mrb_polarssl_par_mode mode;
+  int encrypt;
+  const unsigned char *key;
+  unsigned int keybits;
+  mbedtls_aes_context aes;   // only read by the chunks
+  unsigned char h[16];       // E(0^128)
+  unsigned char ej0z[16];    // E(0^96 || 1), J0 of the IV par_ghash uses
+} par_job;
+
+typedef struct par_chunk {
+  mrb_polarssl_task task;
+  const par_job *job;
+  const unsigned char *input;
+  unsigned char *output;
+  size_t len;
+  unsigned char ctr[16];  // counter block for the chunk's first block
+  unsigned char t[16];    // GCM: GHASH of the chunk's ciphertext, times H
+  int submitted;
+  int ret;
+} par_chunk;
+
+#if defined(MBEDTLS_GCM_C)
+// t = GHASH(data) * H, read off an mbedtls GCM tag with data as AAD and an
+// all zero IV: tag = (GHASH(data) ^ L) * H ^ E(J0), L the length block.
+static int par_ghash(const par_job *job, const unsigned char *data, size_t len, unsigned char t[16]) {
+  mbedtls_gcm_context gcm;
+  unsigned char iv[12], lenblk[16];
+  size_t olen;
+  int i, ret;
+
+  memset(iv, 0, sizeof(iv));
+  mbedtls_gcm_init(&gcm);
+  ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, job->key, job->keybits);
+  if (ret == 0)
+    ret = mbedtls_gcm_starts(&gcm, MBEDTLS_GCM_ENCRYPT, iv, sizeof(iv));
+  if (ret == 0)
+    ret = mbedtls_gcm_update_ad(&gcm, data, len);
+  if (ret == 0)
+    ret = mbedtls_gcm_finish(&gcm, NULL, 0, &olen, t, 16);
+  mbedtls_gcm_free(&gcm);
+  if (ret != 0)
+    return ret;
+
+  put_be64(lenblk, (uint64_t) len * 8);
+  put_be64(lenblk + 8, 0);
+  gf_mult(lenblk, job->h, lenblk);
+  for (i = 0; i < 16; i++)
+    t[i] ^= job->ej0z[i] ^ lenblk[i];
+  return 0;
+}
+#endif
+
+// Runs on a worker thread or inline.
+static void par_chunk_run(void *arg) {
+  par_chunk *c = arg;
+  const par_job *job = c->job;
+  unsigned char stream[16];
+  size_t off, nc_off = 0;
+  int ret = 0;
+
+  if (job->mode == MRB_POLARSSL_PAR_ECB) {
+    for (off = 0; off < c->len && ret == 0; off += 16)
+      ret = mbedtls_aes_crypt_ecb((mbedtls_aes_context *) &job->aes, job->encrypt ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT,
+                                  c->input + off, c->output + off);
+    c->ret = ret;
+    return;
+  }
+
+#if defined(MBEDTLS_GCM_C)
+  if (job->mode == MRB_POLARSSL_PAR_GCM && !job->encrypt)
+    ret = par_ghash(job, c->input, c->len, c->t);
+#endif
+#if defined(MBEDTLS_CIPHER_MODE_CTR)
+  if (ret == 0)
+    ret = mbedtls_aes_crypt_ctr((mbedtls_aes_context *) &job->aes, c->len, &nc_off, c->ctr, stream,
+                                c->input, c->output);
+#else
+  (void) stream; (void) nc_off;
+  ret = MBEDTLS_ERR_AES_BAD_INPUT_DATA;
+#endif
+#if defined(MBEDTLS_GCM_C)
+  if (ret == 0 && job->mode == MRB_POLARSSL_PAR_GCM && job->encrypt)
+    ret = par_ghash(job, c->output, c->len, c->t);
+#endif
+  c->ret = ret;
+}
+
+int mrb_polarssl_aes_parallel(enum mrb_polarssl_par_mode mode, int encrypt,
+                              const unsigned char *key, unsigned int keybits,
+                              const unsigned char *iv, size_t iv_len,
+                              const unsigned char *aad, size_t aad_len,
+                              const unsigned char *input, unsigned char *output, size_t len,
+                              unsigned char tag[16], int nchunks) {
+  par_job job;
+  par_chunk single, *chunks;
+  unsigned char j0[16], ej0[16], acc[16], hn[16], lenblk[16], diff;
+  size_t blocks, per, off;
+  int i, ret;
+
+  if (mode == MRB_POLARSSL_PAR_ECB && len % 16 != 0)
+    return MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH;
+  if (mode == MRB_POLARSSL_PAR_CTR && iv_len != 16)
+    return MBEDTLS_ERR_AES_BAD_INPUT_DATA;
+#if defined(MBEDTLS_GCM_C)
+  // other IV lengths go through GHASH; mbedtls_gcm handles those serially
+  if (mode == MRB_POLARSSL_PAR_GCM && (iv_len != 12 || (uint64_t) len > ((uint64_t) 1 << 36) - 32))
+    return MBEDTLS_ERR_GCM_BAD_INPUT;
+#else
+  if (mode == MRB_POLARSSL_PAR_GCM)
+    return MBEDTLS_ERR_AES_BAD_INPUT_DATA;
+#endif
+
+  memset(&job, 0, sizeof(job));
+  job.mode = mode;
+  job.encrypt = encrypt;
+  job.key = key;
+  job.keybits = keybits;
+  mbedtls_aes_init(&job.aes);
+  if (mode == MRB_POLARSSL_PAR_ECB && !encrypt)
+    ret = mbedtls_aes_setkey_dec(&job.aes, key, keybits);
+  else
+    ret = mbedtls_aes_setkey_enc(&job.aes, key, keybits);
+  if (ret != 0)
+    goto cleanup;
+
+  memset(acc, 0, 16);
+  if (mode == MRB_POLARSSL_PAR_GCM) {
+    memset(j0, 0, 16);
+    j0[15] = 1;
+    if ((ret = mbedtls_aes_crypt_ecb(&job.aes, MBEDTLS_AES_ENCRYPT, j0, job.ej0z)) != 0)
+      goto cleanup;
+    memset(j0, 0, 16);
+    if ((ret = mbedtls_aes_crypt_ecb(&job.aes, MBEDTLS_AES_ENCRYPT, j0, job.h)) != 0)
+      goto cleanup;
+    memcpy(j0, iv, 12);
+    j0[15] = 1;
+    if ((ret = mbedtls_aes_crypt_ecb(&job.aes, MBEDTLS_AES_ENCRYPT, j0, ej0)) != 0)
+      goto cleanup;
+#if defined(MBEDTLS_GCM_C)
+    if (aad_len > 0 && (ret = par_ghash(&job, aad, aad_len, acc)) != 0)
+      goto cleanup;
+#endif
+  }
+
+  blocks = (len + 15) / 16;
+  if (nchunks < 1 || blocks == 0)
+    nchunks = 1;
+  if ((size_t) nchunks > blocks && blocks > 0)
+    nchunks = (int) blocks;
+  per = blocks == 0 ? 0 : (blocks + nchunks - 1) / nchunks;
+  if (per > 0)
+    nchunks = (int) ((blocks + per - 1) / per);
+
+  chunks = nchunks > 1 ? calloc(nchunks, sizeof(par_chunk)) : NULL;
+  if (chunks == NULL) {
+    // out of memory just means no parallelism
+    nchunks = 1;
+    per = blocks;
+    chunks = &single;
+    memset(&single, 0, sizeof(single));
+  }
+
+  for (i = 0, off = 0; i < nchunks; i++, off += per * 16) {
+    par_chunk *c = &chunks[i];
+
+    c->job = &job;
+    c->input = input + off;
+    c->output = output + off;
+    c->len = len - off < per * 16 ? len - off : per * 16;
+    if (mode == MRB_POLARSSL_PAR_GCM) {
+      memcpy(c->ctr, j0, 16);
+      ctr_add(c->ctr, 1 + (uint64_t) i * per);
+    } else if (mode == MRB_POLARSSL_PAR_CTR) {
+      memcpy(c->ctr, iv, 16);
+      ctr_add(c->ctr, (uint64_t) i * per);
+    }
+    c->task.func = par_chunk_run;
+    c->task.arg = c;
+    c->task.notify_fd = -1;
+  }
+
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  for (i = 1; i < nchunks; i++)
+    chunks[i].submitted = mrb_polarssl_pool_submit(&chunks[i].task) == 0;
+#endif
+  par_chunk_run(&chunks[0]);
+  for (i = 1; i < nchunks; i++) {
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+    // chunks still queued (e.g. behind handshakes waiting on the network)
+    // are taken back and run here rather than waited for
+    if (chunks[i].submitted && !mrb_polarssl_pool_cancel(&chunks[i].task)) {
+      mrb_polarssl_pool_wait(&chunks[i].task);
+      continue;
+    }
+#endif
+    par_chunk_run(&chunks[i]);
+  }
+
+  ret = 0;
+  for (i = 0; i < nchunks && ret == 0; i++)
+    ret = chunks[i].ret;
+
+  if (ret == 0 && mode == MRB_POLARSSL_PAR_GCM) {
+    // GHASH is linear: acc = acc * H^blocks ^ t per chunk gives
+    // GHASH(A, C) * H without the length block
+    for (i = 0; i < nchunks; i++) {
+      gf_pow(job.h, (chunks[i].len + 15) / 16, hn);
+      gf_mult(acc, hn, acc);
+      for (off = 0; off < 16; off++)
+        acc[off] ^= chunks[i].t[off];
+    }
+    put_be64(lenblk, (uint64_t) aad_len * 8);
+    put_be64(lenblk + 8, (uint64_t) len * 8);
+    gf_mult(lenblk, job.h, lenblk);
+    for (off = 0; off < 16; off++)
+      acc[off] ^= lenblk[off] ^ ej0[off];
+
+    if (encrypt) {
+      memcpy(tag, acc, 16);
+    } else {
+      diff = 0;
+      for (off = 0; off < 16; off++)
+        diff |= acc[off] ^ tag[off];
+      if (diff != 0) {
+        memset(output, 0, len);
+        ret = MBEDTLS_ERR_GCM_AUTH_FAILED;
+      }
+    }
+  }
+
+  if (chunks != &single)
+    free(chunks);
+cleanup:
+  mbedtls_aes_free(&job.aes);
+  return ret;
+}
+
+#endif /* MBEDTLS_AES_C */
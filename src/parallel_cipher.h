@@ -0,0 +1,31 @@
+#ifndef MRUBY_POLARSSL_PARALLEL_CIPHER_H
+#define MRUBY_POLARSSL_PARALLEL_CIPHER_H
+
+#include <stddef.h>
+
+/*
+ * AES in the parallelizable modes, split into nchunks pieces that run on
+ * the worker pool (the calling thread takes the first one, and any chunk
+ * no worker has picked up yet when it is done). Chunks use mbedtls'
+ * CTR and GCM code at their own counter offset; for GCM the per chunk
+ * GHASH values are folded together afterwards. Without a worker pool the
+ * chunks simply run one after another.
+ */
+
+enum mrb_polarssl_par_mode {
+  MRB_POLARSSL_PAR_ECB = 0,
+  MRB_POLARSSL_PAR_CTR,
+  MRB_POLARSSL_PAR_GCM
+};
+
+// iv: CTR takes the 16 byte initial counter block, GCM a 12 byte IV.
+// tag: GCM only; written when encrypting, checked when decrypting.
+// Returns 0 or an mbedtls error code.
+int mrb_polarssl_aes_parallel(enum mrb_polarssl_par_mode mode, int encrypt,
+                              const unsigned char *key, unsigned int keybits,
+                              const unsigned char *iv, size_t iv_len,
+                              const unsigned char *aad, size_t aad_len,
+                              const unsigned char *input, unsigned char *output, size_t len,
+                              unsigned char tag[16], int nchunks);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include "mruby/variable.h"
 #include "mruby/hash.h"
+#include "mruby/error.h"
 
 /*#include "mruby/ext/context_log.h"*/
 
@@ -15,10 +16,21 @@
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/ssl.h"
 #include "mbedtls/des.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
 #include "mbedtls/base64.h"
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/version.h"
 #include "mbedtls/debug.h"
+#include "mbedtls/timing.h"
+#include "mbedtls/ssl_cookie.h"
+#include "mbedtls/ssl_cache.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/oid.h"
+#include "mbedtls/platform_util.h"
+#if defined(MBEDTLS_PSA_CRYPTO_C)
+#include "psa/crypto.h"
+#endif
 // #include "mbedtls/ssl_misc.h" // for mbedtls_ssl_own_key, mbedtls_ssl_own_cert
 
 #if defined(_WIN32)
@@ -26,16 +38,33 @@
 #define ioctl ioctlsocket
 #else
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <poll.h>
 #endif
+#include <errno.h>
+#include <time.h>
 
 /*ECDSA*/
 #include "mbedtls/ecdsa.h"
+#include "mbedtls/ecdh.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include <fcntl.h> // for blocking/nonblocking sockets
 
+#include "worker_pool.h"
+#include "allocator.h"
+#include "parallel_cipher.h"
+#include "shared.h"
+#ifdef MRUBY_POLARSSL_THREADING
+#include "mbedtls/threading.h"
+#endif
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+#include <pthread.h>
+#endif
+
 #if MRUBY_RELEASE_NO < 10000
 static struct RClass *mrb_module_get(mrb_state *mrb, const char *name) {
   return mrb_class_get(mrb, name);
@@ -44,34 +73,248 @@ static struct RClass *mrb_module_get(mrb_state *mrb, const char *name) {
 
 extern struct mrb_data_type mrb_io_type;
 
+// Where the SSL engine sends and receives its ciphertext.
+enum mrb_ssl_transport {
+  MRB_SSL_TRANSPORT_NONE = 0,
+  MRB_SSL_TRANSPORT_SOCKET,   // mbedtls_net_* on an mruby-io fd
+  MRB_SSL_TRANSPORT_MEMORY,   // SSL#feed / SSL#drain
+  MRB_SSL_TRANSPORT_CALLBACK  // user supplied Ruby callables
+};
+
+typedef struct {
+  unsigned char *ptr;
+  size_t len;
+  size_t off;
+  size_t capa;
+} mrb_ssl_buf_t;
+
+#if defined(MBEDTLS_SHA256_C) && defined(MBEDTLS_X509_CRT_PARSE_C) && \
+    defined(MBEDTLS_SSL_KEEP_PEER_CERTIFICATE)
+#define MRB_SSL_VERIFY_CACHE 1
+
+// PolarSSL::SSL::VerifyCache: the chain that last passed verification for
+// a hostname and trust store.
+typedef struct {
+  unsigned char key[32];    // SHA-256 over trust store and hostname
+  unsigned char chain[32];  // SHA-256 over the peer's chain
+  time_t expires;
+  uint64_t used;          // LRU clock value, 0 for a free slot
+} mrb_ssl_vcache_entry;
+
+typedef struct {
+  mrb_ssl_vcache_entry *entries;
+  mrb_int capa;
+  mrb_int ttl;
+  uint64_t clock;
+  mrb_int hits;
+  mrb_int misses;
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  pthread_mutex_t lock;  // looked up from handshake_async workers and other VMs
+#endif
+} mrb_ssl_vcache_t;
+
+// A pthread mutex, not an mbedtls one: handshake_async workers use the
+// cache whenever the pool is built, MBEDTLS_THREADING_C or not.
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+#define MRB_SSL_VCACHE_LOCK(vc)   pthread_mutex_lock(&(vc)->lock)
+#define MRB_SSL_VCACHE_UNLOCK(vc) pthread_mutex_unlock(&(vc)->lock)
+#else
+#define MRB_SSL_VCACHE_LOCK(vc)
+#define MRB_SSL_VCACHE_UNLOCK(vc)
+#endif
+
+// What the current handshake does with the cache
+#define MRB_SSL_VCACHE_IDLE   0  // no handshake() in progress
+#define MRB_SSL_VCACHE_VERIFY 1  // mbedtls verifies, a chain that passes is stored
+#define MRB_SSL_VCACHE_TRUST  2  // verification off, the chain must match vchain
+#endif
+
+#if defined(MBEDTLS_SSL_CACHE_C) && defined(MBEDTLS_SSL_SRV_C)
+#define MRB_SSL_SESSION_CACHE 1
+#endif
+
 typedef struct {
   mbedtls_ssl_context ssl;
   mbedtls_ssl_config conf;
   const char **alpns;
   mbedtls_x509_crt ca_chain;
+  mbedtls_x509_crt *ca;  // &ca_chain or an SSL::CAChain's, NULL for none
   mbedtls_x509_crt client_cert;
   mbedtls_pk_context client_pkey;
   struct mrb_io *fptr;
+  mrb_state *mrb;
+  enum mrb_ssl_transport transport;
+  mrb_ssl_buf_t bio_in;
+  mrb_ssl_buf_t bio_out;
+  mrb_ssl_buf_t rbuf;
+  mrb_ssl_buf_t wbuf;
+  mrb_value bio_sender;
+  mrb_value bio_receiver;
+  mrb_value bio_exc;
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+  mrb_polarssl_mem_owner *mem;
+#endif
+  mrb_bool datagram;
+  mrb_bool server;
+#ifdef MRB_SSL_VERIFY_CACHE
+  mrb_ssl_vcache_t *vcache;
+  unsigned char ca_digest[32];
+  unsigned char vkey[32];    // cache key: trust store and hostname
+  unsigned char vchain[32];  // chain the cache holds for vkey
+  char vhost[256];           // hostname for verifying a chain that changed
+  int vstate;                // MRB_SSL_VCACHE_*
+#endif
+#if defined(MBEDTLS_SSL_PROTO_DTLS) && defined(MBEDTLS_TIMING_C)
+  mbedtls_timing_delay_context timer;
+#endif
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+  mbedtls_ssl_cookie_ctx cookie;
+  unsigned char cli_id[128];  // peer address, binds HelloVerify cookies
+  size_t cli_id_len;
+#endif
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  mrb_polarssl_task hs_task;
+  mrb_bool hs_active;
+  int hs_ret;
+  int hs_fds[2];
+  mbedtls_net_context hs_net;  // dup of the socket, so closing the IO can't race the worker
+  mrb_bool hs_nonblock;
+#endif
 } mrb_ssl_t;
 
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+static void mrb_ssl_handshake_release(mrb_ssl_t *mrbssl) {
+  if (mrbssl->hs_fds[0] >= 0) close(mrbssl->hs_fds[0]);
+  if (mrbssl->hs_fds[1] >= 0) close(mrbssl->hs_fds[1]);
+  mrbssl->hs_fds[0] = mrbssl->hs_fds[1] = -1;
+  if (mrbssl->hs_net.fd >= 0) {
+    mbedtls_net_free(&mrbssl->hs_net);
+    // back to the IO's own fd
+    if (mrbssl->hs_nonblock)
+      mbedtls_ssl_set_bio( &mrbssl->ssl, mrbssl->fptr, mbedtls_net_send, mbedtls_net_recv, NULL );
+    else
+      mbedtls_ssl_set_bio( &mrbssl->ssl, mrbssl->fptr, mbedtls_net_send, NULL, mbedtls_net_recv_timeout );
+  }
+  mrbssl->hs_active = FALSE;
+}
+#endif
+
 static void mrb_ssl_free(mrb_state *mrb, void *ptr) {
   mrb_ssl_t *mrbssl = ptr;
 
   if (mrbssl != NULL) {
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+    // a worker may still be using the context
+    if (mrbssl->hs_active) {
+      if (!mrb_polarssl_pool_cancel(&mrbssl->hs_task)) {
+        // wakes a worker blocked on the peer
+        shutdown(mrbssl->hs_net.fd, SHUT_RDWR);
+        mrb_polarssl_pool_wait(&mrbssl->hs_task);
+      }
+      mrb_ssl_handshake_release(mrbssl);
+    }
+#endif
     mbedtls_ssl_free(&mrbssl->ssl);
     mbedtls_ssl_config_free(&mrbssl->conf);
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+    mbedtls_ssl_cookie_free(&mrbssl->cookie);
+#endif
     mbedtls_x509_crt_free(&mrbssl->ca_chain);
     mbedtls_pk_free(&mrbssl->client_pkey);
     mbedtls_x509_crt_free(&mrbssl->client_cert);
+    mrb_free(mrb, mrbssl->bio_in.ptr);
+    mrb_free(mrb, mrbssl->bio_out.ptr);
+    mrb_free(mrb, mrbssl->rbuf.ptr);
+    mrb_free(mrb, mrbssl->wbuf.ptr);
     mrb_free(mrb, mrbssl->alpns);
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+    mrb_polarssl_mem_owner_release(mrbssl->mem);
+#endif
     mrb_free(mrb, mrbssl);
   }
 }
 
-static struct mrb_data_type mrb_entropy_type = { "Entropy", mrb_free };
-static struct mrb_data_type mrb_ctr_drbg_type = { "CtrDrbg", mrb_free };
+// Entropy objects; ctx comes first so the data pointer is also a plain
+// mbedtls_entropy_context *.
+typedef struct {
+  mbedtls_entropy_context ctx;
+  unsigned char seed[MBEDTLS_ENTROPY_BLOCK_SIZE];
+  size_t seed_len;
+  mrb_bool seed_source;
+  mrb_bool seed_used;  // seed_poll handed the seed out
+  char *seed_path;     // file emptied by load_seed_file, to be written again
+} mrb_entropy_t;
+
+#if defined(MBEDTLS_FS_IO)
+// Refills the seed file load_seed_file emptied: from drbg once the seed
+// went into it, from the entropy pool if it went elsewhere, and with the
+// same bytes if nothing took them. Returns an mbedtls error code.
+static int mrb_entropy_refill_seed_file(mrb_state *mrb, mrb_entropy_t *entropy, mbedtls_ctr_drbg_context *drbg) {
+  FILE *f;
+  int ret = 0;
+
+  if (entropy->seed_path == NULL)
+    return 0;
+  if (entropy->seed_used && drbg != NULL) {
+    ret = mbedtls_ctr_drbg_write_seed_file(drbg, entropy->seed_path);
+  } else if (entropy->seed_used) {
+    ret = mbedtls_entropy_write_seed_file(&entropy->ctx, entropy->seed_path);
+  } else if ((f = fopen(entropy->seed_path, "wb")) != NULL) {
+    if (fwrite(entropy->seed, 1, entropy->seed_len, f) != entropy->seed_len)
+      ret = MBEDTLS_ERR_ENTROPY_FILE_IO_ERROR;
+    fclose(f);
+  } else {
+    ret = MBEDTLS_ERR_ENTROPY_FILE_IO_ERROR;
+  }
+  mbedtls_platform_zeroize(entropy->seed, sizeof(entropy->seed));
+  entropy->seed_len = 0;
+  mrb_free(mrb, entropy->seed_path);
+  entropy->seed_path = NULL;
+  return ret;
+}
+#endif
+
+static void mrb_entropy_free(mrb_state *mrb, void *ptr) {
+  if (ptr != NULL) {
+#if defined(MBEDTLS_FS_IO)
+    mrb_entropy_refill_seed_file(mrb, ptr, NULL);
+#endif
+    mbedtls_entropy_free(ptr);
+    mrb_free(mrb, ptr);
+  }
+}
+
+static struct mrb_data_type mrb_entropy_type = { "Entropy", mrb_entropy_free };
+static void mrb_ctr_drbg_free(mrb_state *mrb, void *ptr) {
+  // the entropy belongs to the Entropy object in @entropy
+  if (ptr != NULL && !mrb_polarssl_shared_release(ptr)) {
+    mbedtls_ctr_drbg_free(ptr);
+    mrb_free(mrb, ptr);
+  }
+}
+
+static struct mrb_data_type mrb_ctr_drbg_type = { "CtrDrbg", mrb_ctr_drbg_free };
 static struct mrb_data_type mrb_ssl_type = { "SSL", mrb_ssl_free };
 
+static mbedtls_ctr_drbg_context *mrb_pkey_rng(mrb_state *mrb);
+static void mrb_raise_mbedtls_error(mrb_state *mrb, struct RClass *cls, const char *label,
+                                    const char *funcname, int rc);
+
+static void mrb_pkey_free(mrb_state *mrb, void *ptr) {
+  mbedtls_pk_context *pk = ptr;
+
+  if (pk != NULL && !mrb_polarssl_shared_release(pk)) {
+    mbedtls_pk_free(pk);
+    mrb_free(mrb, pk);
+  }
+}
+
+static struct mrb_data_type mrb_pkey_type = { "PKey", mrb_pkey_free };
+
+static mrb_bool mrb_pkey_p(mrb_value obj) {
+  return mrb_type(obj) == MRB_TT_DATA && DATA_TYPE(obj) == &mrb_pkey_type && DATA_PTR(obj) != NULL;
+}
+
 static void entropycheck(mrb_state *mrb, mrb_value self, mbedtls_entropy_context **entropyp) {
   mbedtls_entropy_context *entropy;
 
@@ -99,12 +342,13 @@ static mrb_value mrb_entropy_initialize(mrb_state *mrb, mrb_value self) {
 
   entropy = (mbedtls_entropy_context *)DATA_PTR(self);
   if (entropy) {
-    mrb_free(mrb, entropy);
+    mrb_entropy_free(mrb, entropy);
   }
   DATA_TYPE(self) = &mrb_entropy_type;
   DATA_PTR(self) = NULL;
 
-  entropy = (mbedtls_entropy_context *)mrb_malloc(mrb, sizeof(mbedtls_entropy_context));
+  entropy = (mbedtls_entropy_context *)mrb_malloc(mrb, sizeof(mrb_entropy_t));
+  memset(entropy, 0, sizeof(mrb_entropy_t));
   DATA_PTR(self) = entropy;
 
   mbedtls_entropy_init(entropy);
@@ -120,7 +364,7 @@ static mrb_value mrb_ctrdrbg_initialize(mrb_state *mrb, mrb_value self) {
 
   ctr_drbg = (mbedtls_ctr_drbg_context *)DATA_PTR(self);
   if (ctr_drbg) {
-    mrb_free(mrb, ctr_drbg);
+    mrb_ctr_drbg_free(mrb, ctr_drbg);
   }
   DATA_TYPE(self) = &mrb_ctr_drbg_type;
   DATA_PTR(self) = NULL;
@@ -137,6 +381,8 @@ static mrb_value mrb_ctrdrbg_initialize(mrb_state *mrb, mrb_value self) {
 
   mbedtls_ctr_drbg_init(ctr_drbg);
 
+  // the context keeps using the entropy for reseeding
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@entropy"), entp);
   if (mrb_string_p(pers)) {
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@pers"), pers);
     ret = mbedtls_ctr_drbg_seed(ctr_drbg, mbedtls_entropy_func, entropy_p, (unsigned char *)RSTRING_PTR(pers), RSTRING_LEN(pers));
@@ -147,6 +393,14 @@ static mrb_value mrb_ctrdrbg_initialize(mrb_state *mrb, mrb_value self) {
   if (ret == MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED ) {
     mrb_raise(mrb, E_RUNTIME_ERROR, "Could not initialize entropy source");
   }
+#if defined(MBEDTLS_FS_IO)
+  // the seed file's next seed comes from this generator
+  if (ret == 0 && ((mrb_entropy_t *) entropy_p)->seed_used) {
+    ret = mrb_entropy_refill_seed_file(mrb, (mrb_entropy_t *) entropy_p, ctr_drbg);
+    if (ret != 0)
+      mrb_raise_mbedtls_error(mrb, E_RUNTIME_ERROR, "error", "mbedtls_ctr_drbg_write_seed_file()", ret);
+  }
+#endif
 
   return self;
 }
@@ -184,6 +438,7 @@ static mrb_value mrb_ctrdrbg_random_bytes(mrb_state *mrb, mrb_value self) {
   return str;
 }
 
+#if defined(MBEDTLS_SELF_TEST)
 static mrb_value mrb_ctrdrbg_self_test() {
   if( mbedtls_ctr_drbg_self_test(0) == 0 ) {
     return mrb_true_value();
@@ -191,8 +446,9 @@ static mrb_value mrb_ctrdrbg_self_test() {
     return mrb_false_value();
   }
 }
+#endif
 
-#define E_MALLOC_FAILED (mrb_class_get_under(mrb,mrb_class_get(mrb, "PolarSSL"),"MallocFailed"))
+#define E_MALLOC_FAILED (mrb_class_get_under(mrb,mrb_module_get(mrb, "PolarSSL"),"MallocFailed"))
 #define E_NETWANTREAD (mrb_class_get_under(mrb,mrb_module_get(mrb, "PolarSSL"),"NetWantRead"))
 #define E_NETWANTWRITE (mrb_class_get_under(mrb,mrb_module_get(mrb, "PolarSSL"),"NetWantWrite"))
 #define E_SSL_ERROR (mrb_class_get_under(mrb,mrb_class_get_under(mrb,mrb_module_get(mrb, "PolarSSL"),"SSL"), "Error"))
@@ -204,28 +460,497 @@ static void mrb_mbedtls_debug(void *ctx, int level,
 {
     mrb_state *mrb = ctx;
     struct RClass *pssl = mrb_module_get(mrb, "PolarSSL");
-    mrb_funcall(mrb, mrb_obj_value(pssl), "debug_message", 4,
-                mrb_fixnum_value(level), mrb_str_new_cstr(mrb, file), mrb_fixnum_value(line), mrb_str_new_cstr(mrb, str));
+    mrb_value threshold = mrb_iv_get(mrb, mrb_obj_value(pssl), mrb_intern_lit(mrb, "@debug_threshold"));
+
+    // mbedtls' threshold is the highest of all VMs, this one's may be lower
+    if (!mrb_fixnum_p(threshold) || level > mrb_fixnum(threshold))
+      return;
+    // a raise from the handler must not leave a connection's scope active
+    MRB_POLARSSL_MEM_LEAVE(
+      mrb_funcall(mrb, mrb_obj_value(pssl), "debug_message", 4,
+                  mrb_fixnum_value(level), mrb_str_new_cstr(mrb, file), mrb_fixnum_value(line), mrb_str_new_cstr(mrb, str)));
+}
+
+static void mrb_raise_mbedtls_error(mrb_state *mrb, struct RClass *cls, const char *label,
+                                    const char *funcname, int rc) {
+  // use sprintf because mrb_raisef doesn't support %x.
+  // mruby-sprintf does but would add a dependency.
+  char buf[256];
+  sprintf(buf, "%d, -0x%X: ", rc, (unsigned) -rc);
+  mbedtls_strerror(rc, buf + strlen(buf), sizeof(buf) - strlen(buf));
+  mrb_raisef(mrb, cls, "%s returned %s [%s]", funcname, label, buf);
+}
+
+static void mrb_raise_ssl_error(mrb_state *mrb, const char *funcname, int rc) {
+  mrb_raise_mbedtls_error(mrb, E_SSL_ERROR, "E_SSL_ERROR", funcname, rc);
 }
 
-static int mbedtls_pk_parse_key_default_rng(mbedtls_pk_context *ctx,
-                                            const unsigned char *key, size_t keylen,
-                                            const unsigned char *pwd, size_t pwdlen)
+static void mrb_ssl_check_idle(mrb_state *mrb, mrb_ssl_t *ssl) {
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  if (ssl->hs_active)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "asynchronous handshake in progress");
+#endif
+}
+
+// A handshake() that skipped chain verification for a cached chain must
+// finish itself: read or write would complete it without the check.
+static void mrb_ssl_check_verified(mrb_state *mrb, mrb_ssl_t *ssl) {
+#ifdef MRB_SSL_VERIFY_CACHE
+  if (ssl->vstate == MRB_SSL_VCACHE_TRUST)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "handshake in progress, call handshake until it returns");
+#endif
+}
+
+static int mbedtls_status_is_ssl_in_progress( int ret )
 {
-  int rc = 0;
-  mbedtls_entropy_context entropy;
-  mbedtls_ctr_drbg_context ctr_drbg;
-  mbedtls_entropy_init(&entropy);
-  mbedtls_ctr_drbg_init(&ctr_drbg);
-  rc = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0);
-  if (rc == 0) {
-    rc = mbedtls_pk_parse_key(ctx, key, keylen, pwd, pwdlen,
-                              &mbedtls_ctr_drbg_random, &ctr_drbg);
-  }
-  mbedtls_ctr_drbg_free(&ctr_drbg);
-  mbedtls_entropy_free(&entropy);
-  return rc;
+  return( ret == MBEDTLS_ERR_SSL_WANT_READ ||
+      ret == MBEDTLS_ERR_SSL_WANT_WRITE ||
+      ret == MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS );
+}
+
+#ifdef MRB_SSL_VERIFY_CACHE
+static void mrb_ssl_vcache_free(mrb_state *mrb, void *ptr) {
+  mrb_ssl_vcache_t *vc = ptr;
+
+  if (vc != NULL && !mrb_polarssl_shared_release(vc)) {
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+    pthread_mutex_destroy(&vc->lock);
+#endif
+    mrb_free(mrb, vc->entries);
+    mrb_free(mrb, vc);
+  }
+}
+
+static struct mrb_data_type mrb_ssl_vcache_type = { "SSL::VerifyCache", mrb_ssl_vcache_free };
+
+// SHA-256 over the DER of every certificate in chain (NULL hashes nothing)
+static void mrb_ssl_digest_chain(const mbedtls_x509_crt *chain, unsigned char out[32]) {
+  mbedtls_sha256_context sha;
+  const mbedtls_x509_crt *crt;
+
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  for (crt = chain; crt != NULL && crt->raw.len > 0; crt = crt->next)
+    mbedtls_sha256_update(&sha, crt->raw.p, crt->raw.len);
+  mbedtls_sha256_finish(&sha, out);
+  mbedtls_sha256_free(&sha);
+}
+
+static time_t mrb_x509_time_epoch(const mbedtls_x509_time *t) {
+  // days from 1970-01-01 for a proleptic Gregorian date
+  int y = t->year - (t->mon <= 2);
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (t->mon + (t->mon > 2 ? -3 : 9)) + 2) / 5 + t->day - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  long days = (long) era * 146097 + doe - 719468;
+
+  return (time_t) days * 86400 + t->hour * 3600 + t->min * 60 + t->sec;
+}
+
+// PolarSSL::SSL::VerifyCache.new(max_entries = 64, ttl = 3600)
+static mrb_value mrb_ssl_vcache_initialize(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_vcache_t *vc;
+  mrb_int capa = 64, ttl = 3600;
+
+  mrb_get_args(mrb, "|ii", &capa, &ttl);
+  if (capa <= 0 || ttl < 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_entries must be positive and ttl not negative");
+
+  vc = (mrb_ssl_vcache_t *) DATA_PTR(self);
+  if (vc) {
+    mrb_ssl_vcache_free(mrb, vc);
+  }
+  DATA_TYPE(self) = &mrb_ssl_vcache_type;
+  DATA_PTR(self) = NULL;
+
+  vc = (mrb_ssl_vcache_t *) mrb_malloc(mrb, sizeof(mrb_ssl_vcache_t));
+  memset(vc, 0, sizeof(mrb_ssl_vcache_t));
+  DATA_PTR(self) = vc;
+  vc->entries = (mrb_ssl_vcache_entry *) mrb_calloc(mrb, capa, sizeof(mrb_ssl_vcache_entry));
+  vc->capa = capa;
+  vc->ttl = ttl;
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  pthread_mutex_init(&vc->lock, NULL);
+#endif
+  return self;
+}
+
+static mrb_value mrb_ssl_vcache_size(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_vcache_t *vc = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_vcache_type, mrb_ssl_vcache_t);
+  time_t now = time(NULL);
+  mrb_int i, n = 0;
+
+  MRB_SSL_VCACHE_LOCK(vc);
+  for (i = 0; i < vc->capa; i++) {
+    if (vc->entries[i].used && vc->entries[i].expires > now)
+      n++;
+  }
+  MRB_SSL_VCACHE_UNLOCK(vc);
+  return mrb_fixnum_value(n);
+}
+
+static mrb_value mrb_ssl_vcache_clear(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_vcache_t *vc = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_vcache_type, mrb_ssl_vcache_t);
+
+  MRB_SSL_VCACHE_LOCK(vc);
+  memset(vc->entries, 0, sizeof(mrb_ssl_vcache_entry) * vc->capa);
+  MRB_SSL_VCACHE_UNLOCK(vc);
+  return self;
+}
+
+static mrb_value mrb_ssl_vcache_hits(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_vcache_t *vc = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_vcache_type, mrb_ssl_vcache_t);
+  mrb_int n;
+
+  MRB_SSL_VCACHE_LOCK(vc);
+  n = vc->hits;
+  MRB_SSL_VCACHE_UNLOCK(vc);
+  return mrb_fixnum_value(n);
+}
+
+static mrb_value mrb_ssl_vcache_misses(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_vcache_t *vc = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_vcache_type, mrb_ssl_vcache_t);
+  mrb_int n;
+
+  MRB_SSL_VCACHE_LOCK(vc);
+  n = vc->misses;
+  MRB_SSL_VCACHE_UNLOCK(vc);
+  return mrb_fixnum_value(n);
+}
+
+static mrb_bool mrb_ssl_vcache_lookup(mrb_ssl_vcache_t *vc, const unsigned char key[32], time_t now,
+                                      unsigned char chain[32]) {
+  mrb_int i;
+
+  for (i = 0; i < vc->capa; i++) {
+    mrb_ssl_vcache_entry *e = &vc->entries[i];
+    if (e->used && memcmp(e->key, key, 32) == 0) {
+      if (e->expires <= now) {
+        e->used = 0;
+        return FALSE;
+      }
+      e->used = ++vc->clock;
+      memcpy(chain, e->chain, 32);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static void mrb_ssl_vcache_insert(mrb_ssl_vcache_t *vc, const unsigned char key[32],
+                                  const unsigned char chain[32], time_t expires) {
+  mrb_ssl_vcache_entry *victim = &vc->entries[0];
+  mrb_int i;
+
+  for (i = 0; i < vc->capa; i++) {
+    if (vc->entries[i].used && memcmp(vc->entries[i].key, key, 32) == 0) {
+      victim = &vc->entries[i];
+      break;
+    }
+    if (vc->entries[i].used < victim->used)
+      victim = &vc->entries[i];
+  }
+  memcpy(victim->key, key, 32);
+  memcpy(victim->chain, chain, 32);
+  victim->expires = expires;
+  victim->used = ++vc->clock;
+}
+
+// Called before the handshake. If the cache holds a chain for this
+// hostname and trust store, the handshake runs with VERIFY_NONE: mbedtls
+// skips the chain (certificate signatures, hostname, key usage) but still
+// checks that the server signed the handshake with the leaf's key, and
+// mrb_ssl_verify_finish compares the chain it sent instead. Without one
+// mbedtls verifies as usual.
+static void mrb_ssl_verify_prepare(mrb_state *mrb, mrb_value self, mrb_ssl_t *ssl) {
+  mbedtls_sha256_context sha;
+  mrb_value host;
+  mrb_bool hit;
+
+  // only a required check has anything to save; handshake() may run again
+  // after NetWantRead
+  if (!ssl->vcache || ssl->vstate != MRB_SSL_VCACHE_IDLE ||
+      ssl->conf.MBEDTLS_PRIVATE(authmode) != MBEDTLS_SSL_VERIFY_REQUIRED)
+    return;
+  host = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@hostname"));
+  if (mrb_string_p(host) && (size_t) RSTRING_LEN(host) >= sizeof(ssl->vhost))
+    return;
+  ssl->vhost[0] = '\0';
+  if (mrb_string_p(host))
+    memcpy(ssl->vhost, RSTRING_PTR(host), RSTRING_LEN(host) + 1);
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, ssl->ca_digest, sizeof(ssl->ca_digest));
+  mbedtls_sha256_update(&sha, (const unsigned char *) ssl->vhost, strlen(ssl->vhost) + 1);
+  mbedtls_sha256_finish(&sha, ssl->vkey);
+  mbedtls_sha256_free(&sha);
+
+  MRB_SSL_VCACHE_LOCK(ssl->vcache);
+  hit = mrb_ssl_vcache_lookup(ssl->vcache, ssl->vkey, time(NULL), ssl->vchain);
+  if (!hit)
+    ssl->vcache->misses++;
+  MRB_SSL_VCACHE_UNLOCK(ssl->vcache);
+  if (hit) {
+    mbedtls_ssl_conf_authmode(&ssl->conf, MBEDTLS_SSL_VERIFY_NONE);
+    ssl->vstate = MRB_SSL_VCACHE_TRUST;
+  } else {
+    ssl->vstate = MRB_SSL_VCACHE_VERIFY;
+  }
+}
+
+// Key usage mbedtls asks of a server certificate for the negotiated suite.
+static unsigned int mrb_ssl_peer_key_usage(mrb_ssl_t *ssl) {
+  const char *suite = mbedtls_ssl_get_ciphersuite(&ssl->ssl);
+
+  if (suite == NULL)
+    return MBEDTLS_X509_KU_DIGITAL_SIGNATURE;
+  if (strncmp(suite, "TLS-RSA-WITH-", 13) == 0 || strncmp(suite, "TLS-RSA-PSK-", 12) == 0)
+    return MBEDTLS_X509_KU_KEY_ENCIPHERMENT;
+  if (strncmp(suite, "TLS-ECDH-RSA-", 13) == 0 || strncmp(suite, "TLS-ECDH-ECDSA-", 15) == 0)
+    return MBEDTLS_X509_KU_KEY_AGREEMENT;
+  return MBEDTLS_X509_KU_DIGITAL_SIGNATURE;
+}
+
+// The checks mbedtls skipped, for a server that sent another chain than
+// the cached one.
+static int mrb_ssl_verify_peer(mrb_ssl_t *ssl, const mbedtls_x509_crt *peer) {
+  uint32_t flags = 0;
+  int ret;
+
+  ret = mbedtls_x509_crt_verify((mbedtls_x509_crt *) peer, ssl->ca, NULL,
+                                ssl->vhost[0] ? ssl->vhost : NULL, &flags, NULL, NULL);
+  if (ret == 0)
+    ret = mbedtls_x509_crt_check_extended_key_usage(peer, MBEDTLS_OID_SERVER_AUTH,
+                                                    MBEDTLS_OID_SIZE(MBEDTLS_OID_SERVER_AUTH));
+  if (ret == 0)
+    ret = mbedtls_x509_crt_check_key_usage(peer, mrb_ssl_peer_key_usage(ssl));
+  return ret != 0 ? MBEDTLS_ERR_X509_CERT_VERIFY_FAILED : 0;
+}
+
+// Called with what the handshake returned; returns what to report. Stores
+// a chain mbedtls accepted, and checks one it did not look at. May run on
+// a worker thread.
+static int mrb_ssl_verify_finish(mrb_ssl_t *ssl, int ret) {
+  const mbedtls_x509_crt *peer, *c;
+  unsigned char chain[32];
+  time_t now, expires;
+  int state = ssl->vstate;
+
+  if (state == MRB_SSL_VCACHE_IDLE || mbedtls_status_is_ssl_in_progress(ret))
+    return ret;
+  ssl->vstate = MRB_SSL_VCACHE_IDLE;
+  if (state == MRB_SSL_VCACHE_TRUST)
+    mbedtls_ssl_conf_authmode(&ssl->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  if (ret != 0 || (peer = mbedtls_ssl_get_peer_cert(&ssl->ssl)) == NULL)
+    return ret;
+
+  // peer->next is the rest of the chain the server sent
+  mrb_ssl_digest_chain(peer, chain);
+  if (state == MRB_SSL_VCACHE_TRUST) {
+    mrb_bool same = memcmp(chain, ssl->vchain, sizeof(chain)) == 0;
+
+    MRB_SSL_VCACHE_LOCK(ssl->vcache);
+    if (same)
+      ssl->vcache->hits++;
+    else
+      ssl->vcache->misses++;
+    MRB_SSL_VCACHE_UNLOCK(ssl->vcache);
+    if (same)
+      return 0;
+    if ((ret = mrb_ssl_verify_peer(ssl, peer)) != 0) {
+      // a later read or write must not use this session
+      mbedtls_ssl_send_alert_message(&ssl->ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                     MBEDTLS_SSL_ALERT_MSG_BAD_CERT);
+      mbedtls_ssl_session_reset(&ssl->ssl);
+      return ret;
+    }
+  }
+
+  // valid until the first certificate in the chain expires, at most ttl
+  now = time(NULL);
+  expires = now + ssl->vcache->ttl;
+  for (c = peer; c != NULL; c = c->next) {
+    time_t valid_to = mrb_x509_time_epoch(&c->valid_to);
+    if (valid_to < expires)
+      expires = valid_to;
+  }
+  for (c = ssl->ca; c != NULL; c = c->next) {
+    time_t valid_to = mrb_x509_time_epoch(&c->valid_to);
+    if (valid_to < expires)
+      expires = valid_to;
+  }
+  if (expires > now) {
+    MRB_SSL_VCACHE_LOCK(ssl->vcache);
+    mrb_ssl_vcache_insert(ssl->vcache, ssl->vkey, chain, expires);
+    MRB_SSL_VCACHE_UNLOCK(ssl->vcache);
+  }
+  return 0;
+}
+#endif
+
+// PolarSSL::SSL::CAChain: a trust store parsed once and handed to any
+// number of connections with SSL.new(ca_chain:).
+static void mrb_ca_chain_free(mrb_state *mrb, void *ptr) {
+  mbedtls_x509_crt *chain = ptr;
+
+  if (chain != NULL && !mrb_polarssl_shared_release(chain)) {
+    mbedtls_x509_crt_free(chain);
+    mrb_free(mrb, chain);
+  }
+}
+
+static struct mrb_data_type mrb_ca_chain_type = { "SSL::CAChain", mrb_ca_chain_free };
+
+#ifdef MRB_SSL_SESSION_CACHE
+// PolarSSL::SSL::SessionCache: sessions a server can resume. mbedtls locks
+// it itself when built with MBEDTLS_THREADING_C.
+static void mrb_session_cache_free(mrb_state *mrb, void *ptr) {
+  mbedtls_ssl_cache_context *cache = ptr;
+
+  if (cache != NULL && !mrb_polarssl_shared_release(cache)) {
+    mbedtls_ssl_cache_free(cache);
+    mrb_free(mrb, cache);
+  }
+}
+
+static struct mrb_data_type mrb_session_cache_type = { "SSL::SessionCache", mrb_session_cache_free };
+
+static void mrb_session_cache_setup(mbedtls_ssl_cache_context *cache, mrb_int capa, mrb_int timeout) {
+  mbedtls_ssl_cache_init(cache);
+  mbedtls_ssl_cache_set_max_entries(cache, (int) capa);
+#if defined(MBEDTLS_HAVE_TIME)
+  mbedtls_ssl_cache_set_timeout(cache, (int) timeout);
+#endif
+}
+
+// PolarSSL::SSL::SessionCache.new(max_entries = 50, timeout = 86400)
+static mrb_value mrb_session_cache_initialize(mrb_state *mrb, mrb_value self) {
+  mbedtls_ssl_cache_context *cache;
+  mrb_int capa = MBEDTLS_SSL_CACHE_DEFAULT_MAX_ENTRIES, timeout = MBEDTLS_SSL_CACHE_DEFAULT_TIMEOUT;
+
+  mrb_get_args(mrb, "|ii", &capa, &timeout);
+  if (capa <= 0 || timeout < 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_entries must be positive and timeout not negative");
+
+  cache = (mbedtls_ssl_cache_context *) DATA_PTR(self);
+  if (cache) {
+    mrb_session_cache_free(mrb, cache);
+  }
+  DATA_TYPE(self) = &mrb_session_cache_type;
+  DATA_PTR(self) = NULL;
+
+  cache = (mbedtls_ssl_cache_context *) mrb_malloc(mrb, sizeof(mbedtls_ssl_cache_context));
+  mrb_session_cache_setup(cache, capa, timeout);
+  DATA_PTR(self) = cache;
+  return self;
+}
+#endif
+
+#if defined(MBEDTLS_FS_IO)
+// Strong source serving the seed loaded by Entropy#load_seed_file. Like
+// the NV seed the bytes are handed out once, later polls return nothing
+// until the next load_seed_file, so a reseed is never credited with them
+// again.
+static int mrb_entropy_seed_poll(void *data, unsigned char *output, size_t len, size_t *olen) {
+  mrb_entropy_t *entropy = data;
+
+  if (len > entropy->seed_len)
+    len = entropy->seed_len;
+  memcpy(output, entropy->seed, len);
+  mbedtls_platform_zeroize(entropy->seed, sizeof(entropy->seed));
+  if (entropy->seed_len > 0)
+    entropy->seed_used = TRUE;
+  entropy->seed_len = 0;
+  *olen = len;
+  return 0;
+}
+
+// Entropy#update_seed_file(path): mixes the file in and writes a new one.
+static mrb_value mrb_entropy_update_seed_file(mrb_state *mrb, mrb_value self) {
+  mbedtls_entropy_context *entropy;
+  const char *path;
+  int ret;
+
+  mrb_get_args(mrb, "z", &path);
+  entropycheck(mrb, self, &entropy);
+  ret = mbedtls_entropy_update_seed_file(entropy, path);
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_RUNTIME_ERROR, "error", "mbedtls_entropy_update_seed_file()", ret);
+  return self;
+}
+
+static mrb_value mrb_entropy_write_seed_file(mrb_state *mrb, mrb_value self) {
+  mbedtls_entropy_context *entropy;
+  const char *path;
+  int ret;
+
+  mrb_get_args(mrb, "z", &path);
+  entropycheck(mrb, self, &entropy);
+  ret = mbedtls_entropy_write_seed_file(entropy, path);
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_RUNTIME_ERROR, "error", "mbedtls_entropy_write_seed_file()", ret);
+  return self;
+}
+
+// Entropy#load_seed_file(path, as_source = false)
+// Like update_seed_file; with as_source the seed is registered as a strong
+// source instead (the runtime counterpart of MBEDTLS_ENTROPY_NV_SEED), so
+// the first CtrDrbg seeded from this entropy doesn't have to wait for the
+// platform source to fill the pool on its own. The file is emptied until
+// then, so no other Entropy loads the same seed, and refilled from that
+// CtrDrbg's output.
+static mrb_value mrb_entropy_load_seed_file(mrb_state *mrb, mrb_value self) {
+  mbedtls_entropy_context *ctx;
+  mrb_entropy_t *entropy;
+  const char *path;
+  mrb_bool as_source = FALSE;
+  FILE *f;
+  size_t n;
+  int ret;
+
+  mrb_get_args(mrb, "z|b", &path, &as_source);
+  entropycheck(mrb, self, &ctx);
+  entropy = (mrb_entropy_t *) ctx;
+
+  if (!as_source) {
+    ret = mbedtls_entropy_update_seed_file(ctx, path);
+    if (ret != 0)
+      mrb_raise_mbedtls_error(mrb, E_RUNTIME_ERROR, "error", "mbedtls_entropy_update_seed_file()", ret);
+    return self;
+  }
+
+  // an earlier seed file first gets its own seed back, or a new one
+  ret = mrb_entropy_refill_seed_file(mrb, entropy, NULL);
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_RUNTIME_ERROR, "error", "mbedtls_entropy_write_seed_file()", ret);
+  if ((f = fopen(path, "rb")) == NULL)
+    mrb_sys_fail(mrb, path);
+  n = fread(entropy->seed, 1, sizeof(entropy->seed), f);
+  fclose(f);
+  if (n == 0)
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "%s: empty seed file", path);
+  if ((f = fopen(path, "wb")) == NULL) {
+    mbedtls_platform_zeroize(entropy->seed, sizeof(entropy->seed));
+    mrb_sys_fail(mrb, path);
+  }
+  fclose(f);
+  entropy->seed_len = n;
+  entropy->seed_used = FALSE;
+  entropy->seed_path = mrb_malloc(mrb, strlen(path) + 1);
+  strcpy(entropy->seed_path, path);
+  if (!entropy->seed_source) {
+    // no threshold: once the seed is used up the source must not hold
+    // up every later reseed
+    ret = mbedtls_entropy_add_source(ctx, mrb_entropy_seed_poll, entropy,
+                                     0, MBEDTLS_ENTROPY_SOURCE_STRONG);
+    if (ret != 0)
+      mrb_raise_mbedtls_error(mrb, E_RUNTIME_ERROR, "error", "mbedtls_entropy_add_source()", ret);
+    entropy->seed_source = TRUE;
+  }
+  return self;
 }
+#endif
 
 static mrb_value mrb_ssl_initialize(mrb_state *mrb, mrb_value self) {
   mrb_ssl_t *mrbssl = NULL;
@@ -235,8 +960,13 @@ static mrb_value mrb_ssl_initialize(mrb_state *mrb, mrb_value self) {
   mrb_value client_cert = mrb_nil_value();
   mrb_value client_key = mrb_nil_value();
   mrb_value client_key_pw = mrb_nil_value();
+  mrb_value transport = mrb_nil_value();
+  mrb_value endpoint = mrb_nil_value();
+  mrb_value connection_id = mrb_nil_value();
+  mrb_value verify_cache = mrb_nil_value();
+  mrb_value session_cache = mrb_nil_value();
 
-  mrb_int kw_num = 6;
+  mrb_int kw_num = 11;
   mrb_int kw_required = 0;
   mrb_value kw_values[kw_num];
 #if MRUBY_RELEASE_MAJOR == 3
@@ -246,7 +976,12 @@ static mrb_value mrb_ssl_initialize(mrb_state *mrb, mrb_value self) {
     mrb_intern_lit(mrb, "ca_chain"),
     mrb_intern_lit(mrb, "client_cert"),
     mrb_intern_lit(mrb, "client_key"),
-    mrb_intern_lit(mrb, "client_key_password")
+    mrb_intern_lit(mrb, "client_key_password"),
+    mrb_intern_lit(mrb, "transport"),
+    mrb_intern_lit(mrb, "endpoint"),
+    mrb_intern_lit(mrb, "connection_id"),
+    mrb_intern_lit(mrb, "verify_cache"),
+    mrb_intern_lit(mrb, "session_cache")
   };
   mrb_kwargs kwargs = { kw_num, kw_required, kw_names, kw_values, NULL };
 #else
@@ -256,7 +991,12 @@ static mrb_value mrb_ssl_initialize(mrb_state *mrb, mrb_value self) {
     "ca_chain",
     "client_cert",
     "client_key",
-    "client_key_password"
+    "client_key_password",
+    "transport",
+    "endpoint",
+    "connection_id",
+    "verify_cache",
+    "session_cache"
   };
   mrb_kwargs kwargs = { kw_num, kw_values, kw_names, kw_required, NULL };
 #endif
@@ -267,6 +1007,11 @@ static mrb_value mrb_ssl_initialize(mrb_state *mrb, mrb_value self) {
   if (!mrb_undef_p(kw_values[3])) client_cert   = kw_values[3];
   if (!mrb_undef_p(kw_values[4])) client_key    = kw_values[4];
   if (!mrb_undef_p(kw_values[5])) client_key_pw = kw_values[5];
+  if (!mrb_undef_p(kw_values[6])) transport     = kw_values[6];
+  if (!mrb_undef_p(kw_values[7])) endpoint      = kw_values[7];
+  if (!mrb_undef_p(kw_values[8])) connection_id = kw_values[8];
+  if (!mrb_undef_p(kw_values[9])) verify_cache  = kw_values[9];
+  if (!mrb_undef_p(kw_values[10])) session_cache = kw_values[10];
 
   mrbssl = (mrb_ssl_t *) DATA_PTR(self);
   if (mrbssl) {
@@ -277,13 +1022,71 @@ static mrb_value mrb_ssl_initialize(mrb_state *mrb, mrb_value self) {
 
   mrbssl = (mrb_ssl_t *)mrb_malloc(mrb, sizeof(mrb_ssl_t));
   memset(mrbssl, 0, sizeof(mrb_ssl_t));
+  mrbssl->mrb = mrb;
+  mrbssl->bio_sender = mrb_nil_value();
+  mrbssl->bio_receiver = mrb_nil_value();
+  mrbssl->bio_exc = mrb_nil_value();
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  mrbssl->hs_fds[0] = mrbssl->hs_fds[1] = -1;
+  mbedtls_net_init(&mrbssl->hs_net);
+#endif
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+  mrbssl->mem = mrb_polarssl_mem_owner_new();
+#endif
   DATA_PTR(self) = mrbssl;
 
   mbedtls_ssl_init(&mrbssl->ssl);
   mbedtls_ssl_config_init(&mrbssl->conf);
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+  mbedtls_ssl_cookie_init(&mrbssl->cookie);
+#endif
+
+  if (!mrb_nil_p(transport)) {
+    if (mrb_obj_equal(mrb, transport, mrb_symbol_value(mrb_intern_lit(mrb, "datagram"))))
+      mrbssl->datagram = TRUE;
+    else if (!mrb_obj_equal(mrb, transport, mrb_symbol_value(mrb_intern_lit(mrb, "stream"))))
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "transport must be :stream or :datagram");
+  }
+  if (!mrb_nil_p(endpoint)) {
+    if (mrb_obj_equal(mrb, endpoint, mrb_symbol_value(mrb_intern_lit(mrb, "server"))))
+      mrbssl->server = TRUE;
+    else if (!mrb_obj_equal(mrb, endpoint, mrb_symbol_value(mrb_intern_lit(mrb, "client"))))
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "endpoint must be :client or :server");
+  }
+#if !defined(MBEDTLS_SSL_PROTO_DTLS) || !defined(MBEDTLS_TIMING_C)
+  if (mrbssl->datagram)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "DTLS is not enabled in this build");
+#endif
+
   mbedtls_ssl_conf_dbg(&mrbssl->conf, mrb_mbedtls_debug, mrb);
-  mbedtls_ssl_config_defaults(&mrbssl->conf, MBEDTLS_SSL_IS_CLIENT,
-      MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  mbedtls_ssl_config_defaults(&mrbssl->conf,
+      mrbssl->server ? MBEDTLS_SSL_IS_SERVER : MBEDTLS_SSL_IS_CLIENT,
+      mrbssl->datagram ? MBEDTLS_SSL_TRANSPORT_DATAGRAM : MBEDTLS_SSL_TRANSPORT_STREAM,
+      MBEDTLS_SSL_PRESET_DEFAULT);
+
+  if (!mrb_nil_p(verify_cache)) {
+#ifdef MRB_SSL_VERIFY_CACHE
+    mrbssl->vcache = DATA_CHECK_GET_PTR(mrb, verify_cache, &mrb_ssl_vcache_type, mrb_ssl_vcache_t);
+    // a server that skips verification wouldn't ask for client certificates
+    if (mrbssl->server)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "verify_cache requires endpoint: :client");
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@verify_cache"), verify_cache);
+#else
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "verify_cache is not supported by this build");
+#endif
+  }
+
+  if (!mrb_nil_p(session_cache)) {
+#ifdef MRB_SSL_SESSION_CACHE
+    mbedtls_ssl_cache_context *cache = DATA_CHECK_GET_PTR(mrb, session_cache, &mrb_session_cache_type, mbedtls_ssl_cache_context);
+    if (!mrbssl->server)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "session_cache requires endpoint: :server");
+    mbedtls_ssl_conf_session_cache(&mrbssl->conf, cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@session_cache"), session_cache);
+#else
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "session_cache is not supported by this build");
+#endif
+  }
 
   if (!mrb_undef_p(kw_values[0])) {
     mbedtls_ssl_conf_read_timeout(&mrbssl->conf, timeout_ms);
@@ -303,19 +1106,32 @@ static mrb_value mrb_ssl_initialize(mrb_state *mrb, mrb_value self) {
       mrb_raisef(mrb, E_RUNTIME_ERROR, "alpn_protocols: mbedtls_ssl_conf_alpn_protocols returned %d\n\n", rc);
   }
 
-  if (!mrb_nil_p(ca_chain)) {
+  if (mrb_type(ca_chain) == MRB_TT_DATA) {
+    // parsed once, possibly shared with other VMs
+    mrbssl->ca = DATA_CHECK_GET_PTR(mrb, ca_chain, &mrb_ca_chain_type, mbedtls_x509_crt);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@ca_chain"), ca_chain);
+    mbedtls_ssl_conf_ca_chain(&mrbssl->conf, mrbssl->ca, NULL);
+  } else if (!mrb_nil_p(ca_chain)) {
     int rc = 0;
     mrb_gc_protect(mrb, ca_chain);
     mrb_str_cat(mrb, ca_chain, "\0", 1);
     mbedtls_x509_crt_init(&mrbssl->ca_chain);
-    rc = mbedtls_x509_crt_parse(&mrbssl->ca_chain, (const unsigned char *) RSTRING_PTR(ca_chain), RSTRING_LEN(ca_chain));
+    MRB_POLARSSL_MEM_SCOPE(mrbssl->mem,
+      rc = mbedtls_x509_crt_parse(&mrbssl->ca_chain, (const unsigned char *) RSTRING_PTR(ca_chain), RSTRING_LEN(ca_chain)));
     if (rc != 0)
       mrb_raisef(mrb, E_RUNTIME_ERROR, "ca_chain: mbedtls_x509_crt_parse returned %d\n\n", rc);
-    mbedtls_ssl_conf_ca_chain(&mrbssl->conf, &mrbssl->ca_chain, NULL);
+    mrbssl->ca = &mrbssl->ca_chain;
+    mbedtls_ssl_conf_ca_chain(&mrbssl->conf, mrbssl->ca, NULL);
   }
+#ifdef MRB_SSL_VERIFY_CACHE
+  // stands in for the trust store generation in cache keys
+  if (mrbssl->vcache)
+    mrb_ssl_digest_chain(mrbssl->ca, mrbssl->ca_digest);
+#endif
   
   if (!mrb_nil_p(client_key) || !mrb_nil_p(client_cert)) {
     int rc = 0;
+    mbedtls_pk_context *own_key;
     if (mrb_nil_p(client_key) || mrb_nil_p(client_cert))
       mrb_raisef(mrb, E_ARGUMENT_ERROR, ":client_key and :client_cert must be provided together");
 
@@ -323,33 +1139,82 @@ static mrb_value mrb_ssl_initialize(mrb_state *mrb, mrb_value self) {
     mbedtls_pk_init(&mrbssl->client_pkey);
 
     mrb_gc_protect(mrb, client_cert);
-    mrb_gc_protect(mrb, client_key);
     mrb_str_cat(mrb, client_cert, "\0", 1);
-    mrb_str_cat(mrb, client_key, "\0", 1);
-    if (!mrb_nil_p(client_key_pw)) {
-      mrb_str_cat(mrb, client_key_pw, "\0", 1);
-      mrb_gc_protect(mrb, client_key_pw);
-    }
-    rc = mbedtls_x509_crt_parse(&mrbssl->client_cert, (const unsigned char *) RSTRING_PTR(client_cert), RSTRING_LEN(client_cert));
+    MRB_POLARSSL_MEM_SCOPE(mrbssl->mem,
+      rc = mbedtls_x509_crt_parse(&mrbssl->client_cert, (const unsigned char *) RSTRING_PTR(client_cert), RSTRING_LEN(client_cert)));
     if (rc != 0)
       mrb_raisef(mrb, E_RUNTIME_ERROR, "client_cert: mbedtls_x509_crt_parse returned %d\n\n", rc);
 
-    // mbedtls 3.0.0 adds RNG requirement to PK parsing. For this we need
-    // Entropy and CtrDrbg.
-    rc = mbedtls_pk_parse_key_default_rng(&mrbssl->client_pkey,
-                                          (const unsigned char *) RSTRING_PTR(client_key),
-                                          RSTRING_LEN(client_key),
-                                          mrb_nil_p(client_key_pw) ? NULL : (const unsigned char *) RSTRING_PTR(client_key_pw),
-                                          mrb_nil_p(client_key_pw) ? 0    : RSTRING_LEN(client_key_pw));
-    if (rc != 0)
-      mrb_raisef(mrb, E_RUNTIME_ERROR, "client_key: mbedtls_pk_parse_key returned %d\n\n", rc);
+    if (mrb_pkey_p(client_key)) {
+      // already parsed PolarSSL::PKey::PKey, shared by reference
+      own_key = (mbedtls_pk_context *) DATA_PTR(client_key);
+      mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@client_key"), client_key);
+    } else {
+      // mbedtls 3.0.0 adds RNG requirement to PK parsing; share PKey.rng
+      // instead of gathering fresh entropy for every connection
+      mbedtls_ctr_drbg_context *rng = mrb_pkey_rng(mrb);
+
+      mrb_gc_protect(mrb, client_key);
+      mrb_str_cat(mrb, client_key, "\0", 1);
+      if (!mrb_nil_p(client_key_pw)) {
+        mrb_str_cat(mrb, client_key_pw, "\0", 1);
+        mrb_gc_protect(mrb, client_key_pw);
+      }
+
+      MRB_POLARSSL_MEM_SCOPE(mrbssl->mem,
+        rc = mbedtls_pk_parse_key(&mrbssl->client_pkey,
+                                  (const unsigned char *) RSTRING_PTR(client_key),
+                                  RSTRING_LEN(client_key),
+                                  mrb_nil_p(client_key_pw) ? NULL : (const unsigned char *) RSTRING_PTR(client_key_pw),
+                                  mrb_nil_p(client_key_pw) ? 0    : RSTRING_LEN(client_key_pw),
+                                  mbedtls_ctr_drbg_random, rng));
+      if (rc != 0)
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "client_key: mbedtls_pk_parse_key returned %d\n\n", rc);
+      own_key = &mrbssl->client_pkey;
+    }
 
-    rc = mbedtls_ssl_conf_own_cert(&mrbssl->conf, &mrbssl->client_cert, &mrbssl->client_pkey);
+    rc = mbedtls_ssl_conf_own_cert(&mrbssl->conf, &mrbssl->client_cert, own_key);
     if (rc != 0)
       mrb_raisef(mrb, E_RUNTIME_ERROR, "client_cert: mbedtls_ssl_conf_own_cert returned %d\n\n", rc);
   }
 
-  mbedtls_ssl_setup( &mrbssl->ssl, &mrbssl->conf );
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+  // our CID is what the peer puts on records it sends us; an empty one still
+  // negotiates the extension so the peer's CID can be used
+  if (!mrb_nil_p(connection_id) && !mrb_false_p(connection_id)) {
+    int rc;
+    if (!mrbssl->datagram)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "connection_id requires transport: :datagram");
+    if (!mrb_string_p(connection_id) && !mrb_true_p(connection_id))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "connection_id must be a String or true");
+    if (mrb_string_p(connection_id) && RSTRING_LEN(connection_id) > MBEDTLS_SSL_CID_IN_LEN_MAX)
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "connection_id is longer than %d bytes", MBEDTLS_SSL_CID_IN_LEN_MAX);
+    rc = mbedtls_ssl_conf_cid(&mrbssl->conf,
+                              mrb_string_p(connection_id) ? RSTRING_LEN(connection_id) : 0,
+                              MBEDTLS_SSL_UNEXPECTED_CID_IGNORE);
+    if (rc != 0)
+      mrb_raise_ssl_error(mrb, "mbedtls_ssl_conf_cid()", rc);
+  }
+#else
+  if (!mrb_nil_p(connection_id) && !mrb_false_p(connection_id))
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "DTLS Connection ID is not enabled in this build");
+#endif
+
+  MRB_POLARSSL_MEM_SCOPE(mrbssl->mem, mbedtls_ssl_setup( &mrbssl->ssl, &mrbssl->conf ));
+
+#if defined(MBEDTLS_SSL_PROTO_DTLS) && defined(MBEDTLS_TIMING_C)
+  if (mrbssl->datagram)
+    mbedtls_ssl_set_timer_cb(&mrbssl->ssl, &mrbssl->timer, mbedtls_timing_set_delay, mbedtls_timing_get_delay);
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+  if (!mrb_nil_p(connection_id) && !mrb_false_p(connection_id)) {
+    int rc = mbedtls_ssl_set_cid(&mrbssl->ssl, MBEDTLS_SSL_CID_ENABLED,
+                                 mrb_string_p(connection_id) ? (const unsigned char *) RSTRING_PTR(connection_id) : NULL,
+                                 mrb_string_p(connection_id) ? RSTRING_LEN(connection_id) : 0);
+    if (rc != 0)
+      mrb_raise_ssl_error(mrb, "mbedtls_ssl_set_cid()", rc);
+  }
+#endif
 
   return self;
 }
@@ -385,9 +1250,49 @@ static mrb_value mrb_ssl_set_rng(mrb_state *mrb, mrb_value self) {
   ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
 
   mbedtls_ssl_conf_rng(&ssl->conf, &mbedtls_ctr_drbg_random, ctr_drbg);
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+  // a DTLS server answers the first ClientHello with a HelloVerifyRequest
+  // cookie, so spoofed sources can't make it do handshake work
+  if (ssl->datagram && ssl->server) {
+    int rc;
+    MRB_POLARSSL_MEM_SCOPE(ssl->mem,
+      rc = mbedtls_ssl_cookie_setup(&ssl->cookie, mbedtls_ctr_drbg_random, ctr_drbg));
+    if (rc != 0)
+      mrb_raise_ssl_error(mrb, "mbedtls_ssl_cookie_setup()", rc);
+    mbedtls_ssl_conf_dtls_cookies(&ssl->conf, mbedtls_ssl_cookie_write, mbedtls_ssl_cookie_check, &ssl->cookie);
+  }
+#endif
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@rng"), rng);
   return mrb_true_value();
 }
 
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+static void mrb_ssl_set_cli_id(mrb_state *mrb, mrb_ssl_t *ssl, const unsigned char *id, size_t len) {
+  int rc;
+
+  if (len > sizeof(ssl->cli_id))
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "client id is too long");
+  memcpy(ssl->cli_id, id, len);
+  ssl->cli_id_len = len;
+  MRB_POLARSSL_MEM_SCOPE(ssl->mem, rc = mbedtls_ssl_set_client_transport_id(&ssl->ssl, id, len));
+  if (rc != 0)
+    mrb_raise_ssl_error(mrb, "mbedtls_ssl_set_client_transport_id()", rc);
+}
+
+// SSL#client_id = str. For DTLS servers on a memory or callback transport:
+// any bytes identifying the peer, usually its address.
+static mrb_value mrb_ssl_set_client_id(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  mrb_value id;
+
+  mrb_get_args(mrb, "S", &id);
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  mrb_ssl_set_cli_id(mrb, ssl, (const unsigned char *) RSTRING_PTR(id), RSTRING_LEN(id));
+  return id;
+}
+#endif
+
 static mrb_value mrb_ssl_set_socket(mrb_state *mrb, mrb_value self) {
   mrb_ssl_t *ssl;
   struct mrb_io *fptr;
@@ -398,40 +1303,297 @@ static mrb_value mrb_ssl_set_socket(mrb_state *mrb, mrb_value self) {
   fptr = DATA_CHECK_GET_PTR(mrb, socket, &mrb_io_type, struct mrb_io);
   ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
   ssl->fptr = fptr;
+  ssl->transport = MRB_SSL_TRANSPORT_SOCKET;
   // choose correct recv callback depending on blocking or nonblocking socket
   if ((fcntl( fptr->fd, F_GETFL ) & O_NONBLOCK ) == O_NONBLOCK)
     mbedtls_ssl_set_bio( &ssl->ssl, fptr, mbedtls_net_send, mbedtls_net_recv, NULL );
   else
     mbedtls_ssl_set_bio( &ssl->ssl, fptr, mbedtls_net_send, NULL, mbedtls_net_recv_timeout );
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C) && !defined(_WIN32)
+  // a connected UDP socket identifies its client by the peer address
+  if (ssl->datagram && ssl->server) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(fptr->fd, (struct sockaddr *) &addr, &addrlen) == 0)
+      mrb_ssl_set_cli_id(mrb, ssl, (const unsigned char *) &addr, addrlen);
+  }
+#endif
   mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@socket"), socket);
   return mrb_true_value();
 }
 
-static mrb_value mrb_ssl_set_hostname(mrb_state *mrb, mrb_value self) {
-  mrb_ssl_t *ssl;
-  const char *hostname = NULL;
+static int mrb_ssl_buf_reserve(mrb_state *mrb, mrb_ssl_buf_t *buf, size_t extra) {
+  unsigned char *ptr;
+  size_t capa;
 
-  mrb_get_args(mrb, "z", &hostname);
-  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
-  mbedtls_ssl_set_hostname(&ssl->ssl, hostname);
+  if (buf->off > 0) {
+    memmove(buf->ptr, buf->ptr + buf->off, buf->len - buf->off);
+    buf->len -= buf->off;
+    buf->off = 0;
+  }
+  if (buf->len + extra <= buf->capa)
+    return 0;
+
+  capa = buf->capa ? buf->capa : 4096;
+  while (capa < buf->len + extra)
+    capa *= 2;
+  // may be called from inside an mbedtls callback, so never raise here
+  ptr = mrb_realloc_simple(mrb, buf->ptr, capa);
+  if (ptr == NULL)
+    return -1;
+  buf->ptr = ptr;
+  buf->capa = capa;
+  return 0;
+}
 
-  return mrb_true_value();
+static int mrb_ssl_memory_send(void *ctx, const unsigned char *data, size_t len) {
+  mrb_ssl_t *ssl = ctx;
+
+  if (mrb_ssl_buf_reserve(ssl->mrb, &ssl->bio_out, len) != 0)
+    return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+  memcpy(ssl->bio_out.ptr + ssl->bio_out.len, data, len);
+  ssl->bio_out.len += len;
+  return (int) len;
 }
 
-static int mbedtls_status_is_ssl_in_progress( int ret )
-{
-  return( ret == MBEDTLS_ERR_SSL_WANT_READ ||
-      ret == MBEDTLS_ERR_SSL_WANT_WRITE ||
-      ret == MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS );
+static int mrb_ssl_memory_recv(void *ctx, unsigned char *data, size_t len) {
+  mrb_ssl_t *ssl = ctx;
+  size_t avail = ssl->bio_in.len - ssl->bio_in.off;
+
+  if (avail == 0)
+    return MBEDTLS_ERR_SSL_WANT_READ;
+  if (len > avail)
+    len = avail;
+  memcpy(data, ssl->bio_in.ptr + ssl->bio_in.off, len);
+  ssl->bio_in.off += len;
+  if (ssl->bio_in.off == ssl->bio_in.len)
+    ssl->bio_in.off = ssl->bio_in.len = 0;
+  return (int) len;
 }
 
-static void mrb_raise_ssl_error(mrb_state *mrb, const char *funcname, int rc) {
-  // use sprintf because mrb_raisef doesn't support %x.
-  // mruby-sprintf does but would add a dependency.
-  char buf[256];
-  sprintf(buf, "%d, -0x%X: ", rc, (unsigned) -rc);
-  mbedtls_strerror(rc, buf + strlen(buf), sizeof(buf) - strlen(buf));
-  mrb_raisef(mrb, E_SSL_ERROR, "%s returned E_SSL_ERROR [%s]", funcname, buf);
+#if MRUBY_RELEASE_NO >= 30100
+static mrb_value mrb_ssl_bio_call(mrb_state *mrb, void *userdata) {
+  mrb_value *argv = userdata;
+  return mrb_funcall(mrb, argv[0], "call", 1, argv[1]);
+}
+
+// Runs a transport callback without letting a Ruby exception unwind through
+// mbedtls. The exception is stashed and re-raised by mrb_ssl_check_bio_exc
+// once the mbedtls call has returned.
+static int mrb_ssl_bio_invoke(mrb_ssl_t *ssl, mrb_value proc, mrb_value arg, mrb_value *result) {
+  mrb_state *mrb = ssl->mrb;
+  mrb_value argv[2];
+  mrb_bool error = FALSE;
+  int ai = mrb_gc_arena_save(mrb);
+
+  argv[0] = proc;
+  argv[1] = arg;
+  *result = mrb_protect_error(mrb, mrb_ssl_bio_call, argv, &error);
+  mrb_gc_arena_restore(mrb, ai);
+  if (error) {
+    ssl->bio_exc = *result;
+    return -1;
+  }
+  return 0;
+}
+
+static int mrb_ssl_callback_send(void *ctx, const unsigned char *data, size_t len) {
+  mrb_ssl_t *ssl = ctx;
+  mrb_value ret;
+  int rc;
+
+  MRB_POLARSSL_MEM_LEAVE(
+    rc = mrb_ssl_bio_invoke(ssl, ssl->bio_sender, mrb_str_new(ssl->mrb, (const char *) data, len), &ret));
+  if (rc != 0)
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+  if (mrb_nil_p(ret))
+    return MBEDTLS_ERR_SSL_WANT_WRITE;
+  if (!mrb_fixnum_p(ret) || mrb_fixnum(ret) < 0 || (size_t) mrb_fixnum(ret) > len)
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+  return (int) mrb_fixnum(ret);
+}
+
+static int mrb_ssl_callback_recv(void *ctx, unsigned char *data, size_t len) {
+  mrb_ssl_t *ssl = ctx;
+  mrb_value ret;
+  int rc;
+
+  MRB_POLARSSL_MEM_LEAVE(rc = mrb_ssl_bio_invoke(ssl, ssl->bio_receiver, mrb_fixnum_value(len), &ret));
+  if (rc != 0)
+    return MBEDTLS_ERR_NET_RECV_FAILED;
+  if (mrb_nil_p(ret))
+    return 0;  // EOF
+  if (!mrb_string_p(ret) || (size_t) RSTRING_LEN(ret) > len)
+    return MBEDTLS_ERR_NET_RECV_FAILED;
+  if (RSTRING_LEN(ret) == 0)
+    return MBEDTLS_ERR_SSL_WANT_READ;
+  memcpy(data, RSTRING_PTR(ret), RSTRING_LEN(ret));
+  return (int) RSTRING_LEN(ret);
+}
+#endif
+
+static void mrb_ssl_check_bio_exc(mrb_state *mrb, mrb_ssl_t *ssl) {
+  mrb_value exc = ssl->bio_exc;
+
+  if (!mrb_nil_p(exc)) {
+    ssl->bio_exc = mrb_nil_value();
+    mrb_exc_raise(mrb, exc);
+  }
+}
+
+static mrb_value mrb_ssl_set_memory_bio(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  ssl->fptr = NULL;
+  ssl->transport = MRB_SSL_TRANSPORT_MEMORY;
+  ssl->bio_in.len = ssl->bio_in.off = 0;
+  ssl->bio_out.len = ssl->bio_out.off = 0;
+  mbedtls_ssl_set_bio( &ssl->ssl, ssl, mrb_ssl_memory_send, mrb_ssl_memory_recv, NULL );
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@socket"), mrb_nil_value());
+  return mrb_true_value();
+}
+
+static mrb_value mrb_ssl_set_bio_callbacks(mrb_state *mrb, mrb_value self) {
+#if MRUBY_RELEASE_NO >= 30100
+  mrb_ssl_t *ssl;
+  mrb_value sender, receiver;
+
+  mrb_get_args(mrb, "oo", &sender, &receiver);
+  if (!mrb_respond_to(mrb, sender, mrb_intern_lit(mrb, "call")) ||
+      !mrb_respond_to(mrb, receiver, mrb_intern_lit(mrb, "call")))
+    mrb_raise(mrb, E_TYPE_ERROR, "sender and receiver must respond to #call");
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  ssl->fptr = NULL;
+  ssl->transport = MRB_SSL_TRANSPORT_CALLBACK;
+  ssl->bio_sender = sender;
+  ssl->bio_receiver = receiver;
+  mbedtls_ssl_set_bio( &ssl->ssl, ssl, mrb_ssl_callback_send, mrb_ssl_callback_recv, NULL );
+  // keep the callables reachable for the GC
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@bio_sender"), sender);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@bio_receiver"), receiver);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@socket"), mrb_nil_value());
+  return mrb_true_value();
+#else
+  // without mrb_protect_error a raising callback would unwind through mbedtls
+  mrb_raise(mrb, E_NOTIMP_ERROR, "set_bio_callbacks needs mruby 3.1 or later");
+  return mrb_nil_value();
+#endif
+}
+
+static mrb_value mrb_ssl_feed(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  mrb_value data;
+
+  mrb_get_args(mrb, "S", &data);
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (ssl->transport != MRB_SSL_TRANSPORT_MEMORY)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "feed requires set_memory_bio");
+  if (mrb_ssl_buf_reserve(mrb, &ssl->bio_in, RSTRING_LEN(data)) != 0)
+    mrb_raise(mrb, E_MALLOC_FAILED, "feed: buffer allocation failed");
+  memcpy(ssl->bio_in.ptr + ssl->bio_in.len, RSTRING_PTR(data), RSTRING_LEN(data));
+  ssl->bio_in.len += RSTRING_LEN(data);
+  return mrb_fixnum_value(RSTRING_LEN(data));
+}
+
+static mrb_value mrb_ssl_drain(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  mrb_value str;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (ssl->transport != MRB_SSL_TRANSPORT_MEMORY)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "drain requires set_memory_bio");
+  str = mrb_str_new(mrb, (char *) ssl->bio_out.ptr, ssl->bio_out.len);
+  ssl->bio_out.len = 0;
+  return str;
+}
+
+static mrb_value mrb_ssl_pending_output(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  return mrb_fixnum_value(ssl->bio_out.len);
+}
+
+static mrb_value mrb_ssl_set_hostname(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  const char *hostname = NULL;
+
+  mrb_get_args(mrb, "z", &hostname);
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mbedtls_ssl_set_hostname(&ssl->ssl, hostname);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@hostname"), mrb_str_new_cstr(mrb, hostname));
+
+  return mrb_true_value();
+}
+
+// Waits until fd is readable or writable. timeout_ms < 0 waits forever.
+// Returns > 0 when ready, 0 on timeout and a negative value on error. Unlike
+// mbedtls_net_poll this is not limited to descriptors below FD_SETSIZE.
+static int mrb_ssl_poll_fd(int fd, int writing, int timeout_ms) {
+#if defined(_WIN32)
+  mbedtls_net_context net;
+  net.fd = fd;
+  return mbedtls_net_poll(&net, writing ? MBEDTLS_NET_POLL_WRITE : MBEDTLS_NET_POLL_READ,
+                          timeout_ms < 0 ? (uint32_t) -1 : (uint32_t) timeout_ms);
+#else
+  struct pollfd pfd;
+  int rc;
+
+  pfd.fd = fd;
+  pfd.events = writing ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+  do {
+    rc = poll(&pfd, 1, timeout_ms);
+  } while (rc < 0 && errno == EINTR);
+  return rc;
+#endif
+}
+
+// Monotonic clock in milliseconds, for timeouts spread over several polls.
+static long long mrb_ssl_now_ms(void) {
+#if defined(_WIN32)
+  return (long long) GetTickCount64();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static int mrb_ssl_step_handshake(mrb_ssl_t *ssl) {
+  int ret;
+
+  MRB_POLARSSL_MEM_SCOPE(ssl->mem, ret = mbedtls_ssl_handshake( &ssl->ssl ));
+  return ret;
+}
+
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+// A HelloVerifyRequest went out: start over and wait for the ClientHello
+// carrying the cookie. No mruby calls, async handshakes use it too.
+static int mrb_ssl_hello_verify_reset(mrb_ssl_t *ssl) {
+  int ret;
+
+  MRB_POLARSSL_MEM_SCOPE(ssl->mem, ret = mbedtls_ssl_session_reset(&ssl->ssl));
+  if (ret == 0) {
+    MRB_POLARSSL_MEM_SCOPE(ssl->mem,
+      ret = mbedtls_ssl_set_client_transport_id(&ssl->ssl, ssl->cli_id, ssl->cli_id_len));
+  }
+  return ret;
+}
+#endif
+
+static void mrb_raise_handshake_error(mrb_state *mrb, int ret) {
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+    mrb_raise(mrb, E_NETWANTREAD, "ssl_handshake() returned MBEDTLS_ERR_SSL_WANT_READ");
+  } else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    mrb_raise(mrb, E_NETWANTWRITE, "ssl_handshake() returned MBEDTLS_ERR_SSL_WANT_WRITE");
+  } else {
+    mrb_raise_ssl_error(mrb, "ssl_handshake()", ret);
+  }
 }
 
 static mrb_value mrb_ssl_handshake(mrb_state *mrb, mrb_value self) {
@@ -440,26 +1602,214 @@ static mrb_value mrb_ssl_handshake(mrb_state *mrb, mrb_value self) {
   mrb_value block = mrb_nil_value();
   mrb_get_args(mrb, "&", &block);
   ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+#ifdef MRB_SSL_VERIFY_CACHE
+  mrb_ssl_verify_prepare(mrb, self, ssl);
+#endif
 
-  while( ( ret = mbedtls_ssl_handshake( &ssl->ssl ) ) != 0 ) {
+  while( ( ret = mrb_ssl_step_handshake( ssl ) ) != 0 ) {
+    mrb_ssl_check_bio_exc(mrb, ssl);
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+    if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
+      if ((ret = mrb_ssl_hello_verify_reset(ssl)) != 0)
+        break;
+      continue;
+    }
+#endif
     if( ! mbedtls_status_is_ssl_in_progress( ret ) )
       break;
     if (!mrb_nil_p(block))
       mrb_yield(mrb, block, self);
+    else if (ssl->transport == MRB_SSL_TRANSPORT_MEMORY)
+      break; // nothing can arrive until the caller feeds more ciphertext
   }
+#ifdef MRB_SSL_VERIFY_CACHE
+  ret = mrb_ssl_verify_finish(ssl, ret);
+#endif
 
   if (ret < 0) {
-    if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
-      mrb_raise(mrb, E_NETWANTREAD, "ssl_handshake() returned MBEDTLS_ERR_SSL_WANT_READ");
-    } else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-      mrb_raise(mrb, E_NETWANTWRITE, "ssl_handshake() returned MBEDTLS_ERR_SSL_WANT_WRITE");
-    } else {
-      mrb_raise_ssl_error(mrb, "ssl_handshake()", ret);
+    mrb_raise_handshake_error(mrb, ret);
+  }
+  return mrb_true_value();
+}
+
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+#define MRB_SSL_DTLS_POLL_MS 50
+#define MRB_SSL_ASYNC_TIMEOUT_MS 30000  // per wait, when SSL.new got no timeout:
+
+// Runs on a pool thread: no mruby calls allowed here.
+static void mrb_ssl_handshake_task(void *arg) {
+  mrb_ssl_t *ssl = arg;
+  mbedtls_net_context *net = &ssl->hs_net;
+  uint32_t timeout = ssl->conf.MBEDTLS_PRIVATE(read_timeout);
+  int ret, rc;
+
+  while( ( ret = mrb_ssl_step_handshake( ssl ) ) != 0 ) {
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+    if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
+      if ((ret = mrb_ssl_hello_verify_reset(ssl)) != 0)
+        break;
+      continue;
+    }
+#endif
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+      break;
+    if (ssl->datagram) {
+      // DTLS retransmits on its own timer, which only runs while we call
+      // back into the handshake; its timeouts end the loop
+      rc = mrb_ssl_poll_fd(net->fd, ret == MBEDTLS_ERR_SSL_WANT_WRITE, MRB_SSL_DTLS_POLL_MS);
+      if (rc < 0) {
+        ret = rc;
+        break;
+      }
+      continue;
     }
+    // nonblocking socket: wait for it here instead of spinning
+    rc = mrb_ssl_poll_fd(net->fd, ret == MBEDTLS_ERR_SSL_WANT_WRITE, timeout ? (int) timeout : MRB_SSL_ASYNC_TIMEOUT_MS);
+    if (rc == 0) {
+      ret = MBEDTLS_ERR_SSL_TIMEOUT;
+      break;
+    } else if (rc < 0) {
+      ret = rc;
+      break;
+    }
+  }
+#ifdef MRB_SSL_VERIFY_CACHE
+  ret = mrb_ssl_verify_finish(ssl, ret);
+#endif
+  ssl->hs_ret = ret;
+}
+
+static mrb_value mrb_ssl_handshake_async(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  int fd;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  if (ssl->transport != MRB_SSL_TRANSPORT_SOCKET)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "handshake_async requires set_socket");
+  fd = ((mbedtls_net_context *) ssl->fptr)->fd;
+  ssl->hs_nonblock = (fcntl(fd, F_GETFL) & O_NONBLOCK) == O_NONBLOCK;
+  // a blocking read without a timeout could hold the worker forever
+  if (!ssl->hs_nonblock && !ssl->datagram && ssl->conf.MBEDTLS_PRIVATE(read_timeout) == 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "handshake_async on a blocking socket needs SSL.new(read_timeout:)");
+  if ((ssl->hs_net.fd = dup(fd)) < 0)
+    mrb_sys_fail(mrb, "dup");
+  fcntl(ssl->hs_net.fd, F_SETFD, FD_CLOEXEC);
+  if (pipe(ssl->hs_fds) != 0) {
+    mrb_ssl_handshake_release(ssl);
+    mrb_sys_fail(mrb, "pipe");
   }
+  fcntl(ssl->hs_fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(ssl->hs_fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl(ssl->hs_fds[0], F_SETFL, fcntl(ssl->hs_fds[0], F_GETFL) | O_NONBLOCK);
+
+  // the debug callback calls into the VM, which the worker must not do
+  mbedtls_ssl_conf_dbg(&ssl->conf, NULL, NULL);
+#ifdef MRB_SSL_VERIFY_CACHE
+  mrb_ssl_verify_prepare(mrb, self, ssl);
+#endif
+  if (ssl->hs_nonblock)
+    mbedtls_ssl_set_bio( &ssl->ssl, &ssl->hs_net, mbedtls_net_send, mbedtls_net_recv, NULL );
+  else
+    mbedtls_ssl_set_bio( &ssl->ssl, &ssl->hs_net, mbedtls_net_send, NULL, mbedtls_net_recv_timeout );
+  ssl->hs_ret = 0;
+  ssl->hs_task.func = mrb_ssl_handshake_task;
+  ssl->hs_task.arg = ssl;
+  ssl->hs_task.notify_fd = ssl->hs_fds[1];
+  ssl->hs_active = TRUE;
+  if (mrb_polarssl_pool_submit(&ssl->hs_task) != 0) {
+    mrb_ssl_handshake_release(ssl);
+    mbedtls_ssl_conf_dbg(&ssl->conf, mrb_mbedtls_debug, mrb);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "could not start handshake worker threads");
+  }
+  return self;
+}
+
+static mrb_value mrb_ssl_handshake_collect(mrb_state *mrb, mrb_value self, mrb_ssl_t *ssl) {
+  int ret = ssl->hs_ret;
+
+  mrb_ssl_handshake_release(ssl);
+  mbedtls_ssl_conf_dbg(&ssl->conf, mrb_mbedtls_debug, mrb);
+  if (ret < 0)
+    mrb_raise_handshake_error(mrb, ret);
   return mrb_true_value();
 }
 
+static mrb_value mrb_ssl_handshake_done_p(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (!ssl->hs_active)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no asynchronous handshake started");
+  if (mrb_polarssl_pool_state(&ssl->hs_task) != MRB_POLARSSL_TASK_DONE)
+    return mrb_false_value();
+  return mrb_ssl_handshake_collect(mrb, self, ssl);
+}
+
+static mrb_value mrb_ssl_handshake_wait(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (!ssl->hs_active)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no asynchronous handshake started");
+  mrb_polarssl_pool_wait(&ssl->hs_task);
+  return mrb_ssl_handshake_collect(mrb, self, ssl);
+}
+
+static mrb_value mrb_ssl_handshake_fd(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (!ssl->hs_active)
+    return mrb_nil_value();
+  return mrb_fixnum_value(ssl->hs_fds[0]);
+}
+
+static mrb_value mrb_polarssl_set_worker_threads(mrb_state *mrb, mrb_value self) {
+  mrb_int size;
+
+  mrb_get_args(mrb, "i", &size);
+  if (size <= 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "worker_threads must be positive");
+  return mrb_fixnum_value(mrb_polarssl_pool_set_size((int) size));
+}
+
+static mrb_value mrb_polarssl_worker_threads(mrb_state *mrb, mrb_value self) {
+  return mrb_fixnum_value(mrb_polarssl_pool_size());
+}
+#endif
+
+static void mrb_raise_write_error(mrb_state *mrb, int ret) {
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+    mrb_raise(mrb, E_NETWANTREAD, "ssl_write() returned MBEDTLS_ERR_SSL_WANT_READ");
+  } else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    mrb_raise(mrb, E_NETWANTWRITE, "ssl_write() returned MBEDTLS_ERR_SSL_WANT_WRITE");
+  } else {
+    mrb_raise_ssl_error(mrb, "ssl_write()", ret);
+  }
+}
+
+#define MRB_SSL_WRITE_CHUNK 16384
+
+// Pushes whatever write_file left in the write buffer. mbedtls wants the
+// very same bytes again after WANT_WRITE, which is why they stay around.
+static int mrb_ssl_flush_pending(mrb_state *mrb, mrb_ssl_t *ssl) {
+  int ret;
+
+  mrb_ssl_check_verified(mrb, ssl);
+  while (ssl->wbuf.off < ssl->wbuf.len) {
+    MRB_POLARSSL_MEM_SCOPE(ssl->mem,
+      ret = mbedtls_ssl_write(&ssl->ssl, ssl->wbuf.ptr + ssl->wbuf.off, ssl->wbuf.len - ssl->wbuf.off));
+    mrb_ssl_check_bio_exc(mrb, ssl);
+    if (ret < 0)
+      return ret;
+    ssl->wbuf.off += ret;
+  }
+  ssl->wbuf.off = ssl->wbuf.len = 0;
+  return 0;
+}
+
 static mrb_value mrb_ssl_write(mrb_state *mrb, mrb_value self) {
   mrb_ssl_t *ssl;
   mrb_value msg;
@@ -468,21 +1818,278 @@ static mrb_value mrb_ssl_write(mrb_state *mrb, mrb_value self) {
 
   mrb_get_args(mrb, "S", &msg);
   ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+
+  // also refuses a handshake that isn't over, see mrb_ssl_check_verified
+  ret = mrb_ssl_flush_pending(mrb, ssl);
+  if (ret < 0)
+    mrb_raise_write_error(mrb, ret);
 
   buffer = RSTRING_PTR(msg);
-  ret = mbedtls_ssl_write(&ssl->ssl, (const unsigned char *)buffer, RSTRING_LEN(msg));
+  MRB_POLARSSL_MEM_SCOPE(ssl->mem, ret = mbedtls_ssl_write(&ssl->ssl, (const unsigned char *)buffer, RSTRING_LEN(msg)));
+  mrb_ssl_check_bio_exc(mrb, ssl);
   if (ret < 0) {
-    if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
-      mrb_raise(mrb, E_NETWANTREAD, "ssl_write() returned MBEDTLS_ERR_SSL_WANT_READ");
-    } else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-      mrb_raise(mrb, E_NETWANTWRITE, "ssl_write() returned MBEDTLS_ERR_SSL_WANT_WRITE");
-    } else {
-      mrb_raise_ssl_error(mrb, "ssl_write()", ret);
-    }
+    mrb_raise_write_error(mrb, ret);
   }
   return mrb_true_value();
 }
 
+static mrb_value mrb_ssl_flush(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  int ret;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  ret = mrb_ssl_flush_pending(mrb, ssl);
+  if (ret < 0)
+    mrb_raise_write_error(mrb, ret);
+  return mrb_true_value();
+}
+
+// Whether mruby-io already read ahead from the IO's descriptor; a plain
+// read() would skip those bytes.
+static mrb_bool mrb_io_read_buffered_p(mrb_state *mrb, mrb_value io, struct mrb_io *fptr) {
+#if MRUBY_RELEASE_NO >= 30200
+  return fptr->buf != NULL && fptr->buf->len > 0;
+#else
+  mrb_value buf = mrb_iv_get(mrb, io, mrb_intern_lit(mrb, "@buf"));
+  return mrb_string_p(buf) && RSTRING_LEN(buf) > 0;
+#endif
+}
+
+static mrb_value mrb_ssl_write_file(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  mrb_value src;
+  mrb_int offset = -1;
+  mrb_int length = -1;
+  mrb_int total = 0;
+  size_t want;
+  ssize_t n;
+  int fd, ret;
+  mrb_bool owned = FALSE;
+
+  mrb_int kw_num = 2;
+  mrb_int kw_required = 0;
+  mrb_value kw_values[kw_num];
+#if MRUBY_RELEASE_MAJOR == 3
+  mrb_sym kw_names[] = {
+    mrb_intern_lit(mrb, "offset"),
+    mrb_intern_lit(mrb, "length")
+  };
+  mrb_kwargs kwargs = { kw_num, kw_required, kw_names, kw_values, NULL };
+#else
+  const char *kw_names[] = {
+    "offset",
+    "length"
+  };
+  mrb_kwargs kwargs = { kw_num, kw_values, kw_names, kw_required, NULL };
+#endif
+  mrb_get_args(mrb, "o:", &src, &kwargs);
+  if (!mrb_undef_p(kw_values[0]) && !mrb_nil_p(kw_values[0])) offset = mrb_int(mrb, kw_values[0]);
+  if (!mrb_undef_p(kw_values[1]) && !mrb_nil_p(kw_values[1])) length = mrb_int(mrb, kw_values[1]);
+  if (mrb_undef_p(kw_values[0]) && mrb_string_p(src)) offset = 0;
+  if (length < -1 || offset < -1)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "offset and length must not be negative");
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+
+  ret = mrb_ssl_flush_pending(mrb, ssl);
+  if (ret < 0)
+    mrb_raise_write_error(mrb, ret);
+
+  if (mrb_string_p(src)) {
+    fd = open(mrb_string_value_cstr(mrb, &src), O_RDONLY);
+    if (fd < 0)
+      mrb_sys_fail(mrb, mrb_string_value_cstr(mrb, &src));
+    owned = TRUE;
+  } else {
+    struct mrb_io *fptr = DATA_CHECK_GET_PTR(mrb, src, &mrb_io_type, struct mrb_io);
+    if (offset < 0 && mrb_io_read_buffered_p(mrb, src, fptr))
+      mrb_raise(mrb, mrb_class_get(mrb, "IOError"), "write_file: the IO has buffered data, pass offset: or read it first");
+    fd = fptr->fd;
+  }
+  if (mrb_ssl_buf_reserve(mrb, &ssl->wbuf, MRB_SSL_WRITE_CHUNK) != 0) {
+    if (owned) close(fd);
+    mrb_raise(mrb, E_MALLOC_FAILED, "write buffer allocation failed");
+  }
+
+  while (length < 0 || total < length) {
+    want = MRB_SSL_WRITE_CHUNK;
+    if (length >= 0 && (size_t) (length - total) < want)
+      want = length - total;
+    if (offset >= 0)
+      n = pread(fd, ssl->wbuf.ptr, want, offset + total);
+    else
+      n = read(fd, ssl->wbuf.ptr, want);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      if (owned) close(fd);
+      mrb_sys_fail(mrb, "write_file");
+    }
+    if (n == 0)
+      break;
+    ssl->wbuf.off = 0;
+    ssl->wbuf.len = n;
+    total += n;
+
+    ret = mrb_ssl_flush_pending(mrb, ssl);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      // nonblocking socket: the chunk stays queued for the next write/flush
+      break;
+    } else if (ret < 0) {
+      ssl->wbuf.off = ssl->wbuf.len = 0;
+      if (owned) close(fd);
+      mrb_raise_write_error(mrb, ret);
+    }
+  }
+
+  if (owned) close(fd);
+  return mrb_fixnum_value(total);
+}
+
+static void mrb_raise_read_error(mrb_state *mrb, int ret) {
+  if (ret == MBEDTLS_ERR_SSL_TIMEOUT) {
+    mrb_raise(mrb, E_SSL_READ_TIMEOUT, "ssl_read() returned E_SSL_READ_TIMEOUT");
+  } else if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+    mrb_raise(mrb, E_NETWANTREAD, "ssl_read() returned MBEDTLS_ERR_SSL_WANT_READ");
+  } else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    mrb_raise(mrb, E_NETWANTWRITE, "ssl_read() returned MBEDTLS_ERR_SSL_WANT_WRITE");
+  } else {
+    mrb_raise_ssl_error(mrb, "ssl_read()", ret);
+  }
+}
+
+#define MRB_SSL_READ_CHUNK 16384
+
+static size_t mrb_ssl_buffered(mrb_ssl_t *ssl) {
+  return ssl->rbuf.len - ssl->rbuf.off;
+}
+
+static mrb_value mrb_ssl_buf_take(mrb_state *mrb, mrb_ssl_buf_t *buf, size_t len) {
+  mrb_value str = mrb_str_new(mrb, (char *) buf->ptr + buf->off, len);
+
+  buf->off += len;
+  if (buf->off == buf->len)
+    buf->off = buf->len = 0;
+  return str;
+}
+
+// Reads one more chunk of plaintext into the read-ahead buffer. Returns the
+// number of bytes added, 0 on EOF.
+static size_t mrb_ssl_fill(mrb_state *mrb, mrb_value self, mrb_ssl_t *ssl) {
+  int ret;
+
+  if (mrb_test(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@eof"))))
+    return 0;
+  mrb_ssl_check_verified(mrb, ssl);
+  if (mrb_ssl_buf_reserve(mrb, &ssl->rbuf, MRB_SSL_READ_CHUNK) != 0)
+    mrb_raise(mrb, E_MALLOC_FAILED, "read buffer allocation failed");
+  MRB_POLARSSL_MEM_SCOPE(ssl->mem, ret = mbedtls_ssl_read(&ssl->ssl, ssl->rbuf.ptr + ssl->rbuf.len, MRB_SSL_READ_CHUNK));
+  mrb_ssl_check_bio_exc(mrb, ssl);
+  if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@eof"), mrb_true_value());
+    return 0;
+  }
+  if (ret < 0)
+    mrb_raise_read_error(mrb, ret);
+  ssl->rbuf.len += ret;
+  return ret;
+}
+
+static long mrb_ssl_memsearch(const unsigned char *buf, size_t from, size_t to,
+                              const char *pat, size_t patlen) {
+  const unsigned char *p;
+
+  if (patlen == 0 || to < patlen)
+    return -1;
+  while (from + patlen <= to) {
+    p = memchr(buf + from, pat[0], to - patlen + 1 - from);
+    if (p == NULL)
+      return -1;
+    if (memcmp(p, pat, patlen) == 0)
+      return (long) (p - buf);
+    from = (p - buf) + 1;
+  }
+  return -1;
+}
+
+// Returns everything up to and including sep. With strict set, running into
+// EOF raises EOFError and exceeding limit raises RangeError; otherwise the
+// partial data is returned like IO#gets does.
+static mrb_value mrb_ssl_read_delimited(mrb_state *mrb, mrb_value self, mrb_ssl_t *ssl,
+                                        const char *sep, size_t seplen, mrb_int limit, mrb_bool strict) {
+  size_t scanned = 0, avail, end;
+  long pos;
+
+  for (;;) {
+    avail = mrb_ssl_buffered(ssl);
+    end = (limit >= 0 && avail > (size_t) limit) ? (size_t) limit : avail;
+    pos = mrb_ssl_memsearch(ssl->rbuf.ptr + ssl->rbuf.off, scanned, end, sep, seplen);
+    if (pos >= 0)
+      return mrb_ssl_buf_take(mrb, &ssl->rbuf, pos + seplen);
+    if (limit >= 0 && avail >= (size_t) limit) {
+      if (strict)
+        mrb_raisef(mrb, E_RANGE_ERROR, "delimiter not found within %i bytes", limit);
+      return mrb_ssl_buf_take(mrb, &ssl->rbuf, limit);
+    }
+    // only the tail that could still start a match needs rescanning
+    scanned = end >= seplen ? end - seplen + 1 : 0;
+    if (mrb_ssl_fill(mrb, self, ssl) == 0) {
+      if (strict)
+        mrb_raise(mrb, mrb_class_get(mrb, "EOFError"), "EOF");
+      if (avail == 0)
+        return mrb_nil_value();
+      return mrb_ssl_buf_take(mrb, &ssl->rbuf, avail);
+    }
+  }
+}
+
+static mrb_value mrb_ssl_gets(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  mrb_value sep = mrb_str_new_lit(mrb, "\n");
+  mrb_int limit = -1;
+
+  mrb_get_args(mrb, "|S!i", &sep, &limit);
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  if (limit == 0)
+    return mrb_str_new_lit(mrb, "");
+  if (mrb_nil_p(sep))
+    return mrb_ssl_read_delimited(mrb, self, ssl, NULL, 0, limit, FALSE);
+  return mrb_ssl_read_delimited(mrb, self, ssl, RSTRING_PTR(sep), RSTRING_LEN(sep), limit, FALSE);
+}
+
+static mrb_value mrb_ssl_read_until(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  mrb_value delim;
+  mrb_int limit = -1;
+
+  mrb_get_args(mrb, "S|i", &delim, &limit);
+  if (RSTRING_LEN(delim) == 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "empty delimiter");
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  return mrb_ssl_read_delimited(mrb, self, ssl, RSTRING_PTR(delim), RSTRING_LEN(delim), limit, TRUE);
+}
+
+static mrb_value mrb_ssl_read_exactly(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  mrb_int len;
+
+  mrb_get_args(mrb, "i", &len);
+  if (len < 0)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Can't read a negative number (%d) of bytes", len);
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  while (mrb_ssl_buffered(ssl) < (size_t) len) {
+    if (mrb_ssl_fill(mrb, self, ssl) == 0)
+      mrb_raise(mrb, mrb_class_get(mrb, "EOFError"), "EOF");
+  }
+  return mrb_ssl_buf_take(mrb, &ssl->rbuf, len);
+}
+
 static mrb_value mrb_ssl_read(mrb_state *mrb, mrb_value self) {
   mrb_ssl_t *ssl;
   mrb_int maxlen = 0;
@@ -493,30 +2100,34 @@ static mrb_value mrb_ssl_read(mrb_state *mrb, mrb_value self) {
   mrb_get_args(mrb, "i", &maxlen);
   if (maxlen < 0)
     mrb_raisef(mrb, E_ARGUMENT_ERROR, "Can't read a negative number (%d) of bytes", maxlen);
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  // data left over from gets/read_until goes first
+  if (mrb_ssl_buffered(ssl) > 0) {
+    if ((size_t) maxlen > mrb_ssl_buffered(ssl))
+      maxlen = mrb_ssl_buffered(ssl);
+    return mrb_ssl_buf_take(mrb, &ssl->rbuf, maxlen);
+  }
   if (mrb_test(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@eof"))))
     mrb_raise(mrb, mrb_class_get(mrb, "EOFError"), "EOF");
 
+  mrb_ssl_check_verified(mrb, ssl);
   buf = mrb_malloc(mrb, maxlen);
   memset(buf, 0, maxlen);
-  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
-  ret = mbedtls_ssl_read(&ssl->ssl, (unsigned char *)buf, maxlen);
+  MRB_POLARSSL_MEM_SCOPE(ssl->mem, ret = mbedtls_ssl_read(&ssl->ssl, (unsigned char *)buf, maxlen));
+  if (!mrb_nil_p(ssl->bio_exc)) {
+    mrb_free(mrb, buf);
+    mrb_ssl_check_bio_exc(mrb, ssl);
+  }
   if ( ret == 0 || buf == NULL) {
     value = mrb_nil_value();
   } else if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
     mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@eof"), mrb_true_value());
     value = mrb_nil_value();
-  } else if (ret == MBEDTLS_ERR_SSL_TIMEOUT) {
-    mrb_free(mrb, buf);
-    mrb_raise(mrb, E_SSL_READ_TIMEOUT, "ssl_read() returned E_SSL_READ_TIMEOUT");
   } else if (ret < 0) {
     mrb_free(mrb, buf);
-    if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
-      mrb_raise(mrb, E_NETWANTREAD, "ssl_read() returned MBEDTLS_ERR_SSL_WANT_READ");
-    } else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-      mrb_raise(mrb, E_NETWANTWRITE, "ssl_read() returned MBEDTLS_ERR_SSL_WANT_WRITE");
-    } else {
-      mrb_raise_ssl_error(mrb, "ssl_read()", ret);
-    }
+    mrb_raise_read_error(mrb, ret);
   } else {
     value = mrb_str_new(mrb, buf, ret);
   }
@@ -530,8 +2141,10 @@ static mrb_value mrb_ssl_close_notify(mrb_state *mrb, mrb_value self) {
   int ret;
 
   ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
 
-  ret = mbedtls_ssl_close_notify(&ssl->ssl);
+  MRB_POLARSSL_MEM_SCOPE(ssl->mem, ret = mbedtls_ssl_close_notify(&ssl->ssl));
+  mrb_ssl_check_bio_exc(mrb, ssl);
   if (ret < 0) {
     mrb_raise(mrb, E_SSL_ERROR, "ssl_close_notify() returned E_SSL_ERROR");
   }
@@ -545,21 +2158,182 @@ static mrb_value mrb_ssl_close(mrb_state *mrb, mrb_value self) {
   return mrb_true_value();
 }
 
+// Lets mbedtls process the records that already arrived, without waiting
+// for more. Handshake messages such as TLS 1.3 NewSessionTickets are
+// consumed, application data is kept in rbuf for the next read. Returns
+// the number of plaintext bytes buffered, 0 if nothing readable arrived,
+// or the mbedtls error (close_notify, EOF, ...) that ended the connection.
+static int mrb_ssl_read_nonblock(mrb_state *mrb, mrb_value self, mrb_ssl_t *ssl) {
+  mbedtls_net_context *net = NULL;
+  unsigned char buf[1024];
+  int ret, flags = 0;
+
+  mrb_ssl_check_verified(mrb, ssl);
+  if (ssl->transport == MRB_SSL_TRANSPORT_SOCKET) {
+    net = (mbedtls_net_context *) ssl->fptr;
+    flags = fcntl(net->fd, F_GETFL);
+    if (!(flags & O_NONBLOCK)) {
+      fcntl(net->fd, F_SETFL, flags | O_NONBLOCK);
+      mbedtls_ssl_set_bio( &ssl->ssl, ssl->fptr, mbedtls_net_send, mbedtls_net_recv, NULL );
+    }
+  } else if (ssl->transport != MRB_SSL_TRANSPORT_MEMORY) {
+    return 0;  // a Ruby receiver may block
+  }
+
+  do {
+    MRB_POLARSSL_MEM_SCOPE(ssl->mem, ret = mbedtls_ssl_read(&ssl->ssl, buf, sizeof(buf)));
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+  } while (ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET);
+#else
+  } while (0);
+#endif
+
+  if (net != NULL && !(flags & O_NONBLOCK)) {
+    fcntl(net->fd, F_SETFL, flags);
+    mbedtls_ssl_set_bio( &ssl->ssl, ssl->fptr, mbedtls_net_send, NULL, mbedtls_net_recv_timeout );
+  }
+  if (ret > 0) {
+    if (mrb_ssl_buf_reserve(mrb, &ssl->rbuf, ret) != 0)
+      mrb_raise(mrb, E_MALLOC_FAILED, "read: buffer allocation failed");
+    memcpy(ssl->rbuf.ptr + ssl->rbuf.len, buf, ret);
+    ssl->rbuf.len += ret;
+    return ret;
+  }
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    return 0;
+  if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == 0)
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@eof"), mrb_true_value());
+  return ret == 0 ? MBEDTLS_ERR_SSL_CONN_EOF : ret;
+}
+
+// Whether read can return something (plaintext or EOF) without blocking.
+// Decrypts the records that already arrived first: check_pending and poll()
+// also count handshake messages such as TLS 1.3 NewSessionTickets, which
+// read consumes and then blocks for the next record. A connection still in
+// its handshake only reports whether anything arrived.
+static mrb_bool mrb_ssl_readable_p(mrb_state *mrb, mrb_value self, mrb_ssl_t *ssl, mrb_bool arrived) {
+  int ret;
+
+  if (mrb_ssl_buffered(ssl) > 0 || mbedtls_ssl_get_bytes_avail(&ssl->ssl) > 0 ||
+      mrb_test(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@eof"))))
+    return TRUE;
+  if (!arrived && !mbedtls_ssl_check_pending(&ssl->ssl))
+    return FALSE;
+  if (!mbedtls_ssl_is_handshake_over(&ssl->ssl))
+    return TRUE;
+  ret = mrb_ssl_read_nonblock(mrb, self, ssl);
+  if (ret < 0 && !mrb_test(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@eof"))))
+    mrb_raise_read_error(mrb, ret);
+  return ret != 0;
+}
+
 static mrb_value mrb_ssl_bytes_available(mrb_state *mrb, mrb_value self) {
   mrb_ssl_t *ssl;
   mrb_int count=0, fd=0;
 
   ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
-  fd = ((mbedtls_net_context *) ssl->fptr)->fd;
-  if (fd) ioctl(fd, FIONREAD, &count);
+  mrb_ssl_check_idle(mrb, ssl);
+  if (ssl->transport == MRB_SSL_TRANSPORT_MEMORY) {
+    count = ssl->bio_in.len - ssl->bio_in.off;
+  } else if (ssl->transport == MRB_SSL_TRANSPORT_SOCKET) {
+    if (ssl->fptr) fd = ((mbedtls_net_context *) ssl->fptr)->fd;
+    if (fd) ioctl(fd, FIONREAD, &count);
+  }
+  // plaintext only: ciphertext on the socket may turn out to be a session
+  // ticket, or half a record
+  mrb_ssl_readable_p(mrb, self, ssl, count > 0);
+  return mrb_fixnum_value(mrb_ssl_buffered(ssl) + mbedtls_ssl_get_bytes_avail(&ssl->ssl));
+}
+
+static mrb_value mrb_ssl_alive_p(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  mrb_bool arrived;
 
-  // https://esp32.com/viewtopic.php?t=1101
-  if (count <= 0) {
-    mbedtls_ssl_read(&ssl->ssl, NULL, 0);
-    count = mbedtls_ssl_get_bytes_avail(&ssl->ssl);
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (mrb_test(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@eof"))))
+    return mrb_false_value();
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  if (ssl->hs_active)
+    return mrb_false_value();
+#endif
+  // unread data left over: not idle
+  if (mrb_ssl_buffered(ssl) > 0 || mbedtls_ssl_get_bytes_avail(&ssl->ssl) > 0)
+    return mrb_false_value();
+  if (ssl->transport == MRB_SSL_TRANSPORT_MEMORY)
+    arrived = ssl->bio_in.len > ssl->bio_in.off;
+  else if (ssl->transport == MRB_SSL_TRANSPORT_SOCKET)
+    arrived = mrb_ssl_poll_fd(((mbedtls_net_context *) ssl->fptr)->fd, 0, 0) != 0;
+  else
+    return mrb_true_value();
+  if (!arrived && !mbedtls_ssl_check_pending(&ssl->ssl))
+    return mrb_true_value();
+  // a session ticket keeps it alive, a close_notify, EOF or error doesn't
+  return mrb_bool_value(mrb_ssl_read_nonblock(mrb, self, ssl) == 0);
+}
+
+static int mrb_ssl_timeout_ms(mrb_state *mrb, mrb_value timeout) {
+  mrb_float secs;
+
+  if (mrb_nil_p(timeout))
+    return -1;
+  secs = mrb_to_flo(mrb, timeout);
+  if (secs < 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative timeout");
+  if (secs * 1000 > 0x7fffffff)
+    return -1;
+  return (int) (secs * 1000);
+}
+
+static mrb_value mrb_ssl_wait(mrb_state *mrb, mrb_value self, int writing) {
+  mrb_ssl_t *ssl;
+  mrb_value timeout = mrb_nil_value();
+  long long start;
+  int rc, timeout_ms, left;
+
+  mrb_get_args(mrb, "|o", &timeout);
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  timeout_ms = mrb_ssl_timeout_ms(mrb, timeout);
+  // plaintext or records mbedtls already pulled off the socket would
+  // never show up in poll()
+  if (!writing && mrb_ssl_readable_p(mrb, self, ssl, FALSE))
+    return self;
+  switch (ssl->transport) {
+  case MRB_SSL_TRANSPORT_SOCKET:
+    break;
+  case MRB_SSL_TRANSPORT_MEMORY:
+    // nothing to wait on, only report the current state
+    if (writing || mrb_ssl_readable_p(mrb, self, ssl, ssl->bio_in.len > ssl->bio_in.off))
+      return self;
+    return mrb_nil_value();
+  default:
+    return self;
+  }
+
+  start = mrb_ssl_now_ms();
+  left = timeout_ms;
+  for (;;) {
+    rc = mrb_ssl_poll_fd(((mbedtls_net_context *) ssl->fptr)->fd, writing, left);
+    if (rc < 0)
+      mrb_sys_fail(mrb, writing ? "wait_writable" : "wait_readable");
+    if (rc == 0)
+      return mrb_nil_value();
+    if (writing || mrb_ssl_readable_p(mrb, self, ssl, TRUE))
+      return self;
+    // only a handshake message or part of a record: keep waiting
+    if (timeout_ms >= 0) {
+      left = timeout_ms - (int) (mrb_ssl_now_ms() - start);
+      if (left < 0) left = 0;
+    }
   }
+}
 
-  return mrb_fixnum_value(count);
+static mrb_value mrb_ssl_wait_readable(mrb_state *mrb, mrb_value self) {
+  return mrb_ssl_wait(mrb, self, 0);
+}
+
+static mrb_value mrb_ssl_wait_writable(mrb_state *mrb, mrb_value self) {
+  return mrb_ssl_wait(mrb, self, 1);
 }
 
 static mrb_value mrb_ssl_set_blocking(mrb_state *mrb, mrb_value self) {
@@ -567,6 +2341,9 @@ static mrb_value mrb_ssl_set_blocking(mrb_state *mrb, mrb_value self) {
   int rc = 0;
   mrb_bool blocking;
   mrb_get_args(mrb, "b", &blocking);
+  mrb_ssl_check_idle(mrb, ssl);
+  if (ssl->transport != MRB_SSL_TRANSPORT_SOCKET)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "blocking= requires set_socket");
   if (!blocking) {
     rc = mbedtls_net_set_nonblock((mbedtls_net_context *) ssl->fptr);
     if (rc != 0)
@@ -591,16 +2368,64 @@ static mrb_value mrb_ssl_set_read_timeout(mrb_state *mrb, mrb_value self) {
   return mrb_fixnum_value(timeout_ms);
 }
 
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+static mrb_value mrb_ssl_memory_usage(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (ssl->mem == NULL)
+    return mrb_nil_value();
+  return mrb_fixnum_value(mrb_polarssl_mem_owner_usage(ssl->mem, NULL));
+}
+
+static mrb_value mrb_ssl_memory_peak(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  size_t peak = 0;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (ssl->mem == NULL)
+    return mrb_nil_value();
+  mrb_polarssl_mem_owner_usage(ssl->mem, &peak);
+  return mrb_fixnum_value(peak);
+}
+#endif
+
+static mrb_value mrb_ssl_datagram_p(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  return mrb_bool_value(ssl->datagram);
+}
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+// The CID the peer asked us to send, nil unless one was negotiated.
+static mrb_value mrb_ssl_peer_connection_id(mrb_state *mrb, mrb_value self) {
+  mrb_ssl_t *ssl;
+  unsigned char cid[MBEDTLS_SSL_CID_OUT_LEN_MAX];
+  size_t len = 0;
+  int enabled = MBEDTLS_SSL_CID_DISABLED;
+  int rc;
+
+  ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  mrb_ssl_check_idle(mrb, ssl);
+  rc = mbedtls_ssl_get_peer_cid(&ssl->ssl, &enabled, cid, &len);
+  if (rc != 0 || enabled != MBEDTLS_SSL_CID_ENABLED)
+    return mrb_nil_value();
+  return mrb_str_new(mrb, (char *) cid, len);
+}
+#endif
+
 static mrb_value mrb_ssl_fileno(mrb_state *mrb, mrb_value self) {
   mrb_ssl_t *ssl;
   mrb_int fd=0;
 
   ssl = DATA_CHECK_GET_PTR(mrb, self, &mrb_ssl_type, mrb_ssl_t);
+  if (ssl->fptr == NULL)
+    return mrb_nil_value();
   fd = ((mbedtls_net_context *) ssl->fptr)->fd;
 
   return mrb_fixnum_value(fd);
 }
 
+#if defined(MBEDTLS_ECDSA_C) && defined(MBEDTLS_PK_PARSE_C)
 static void mrb_ecdsa_free(mrb_state *mrb, void *ptr) {
   mbedtls_ecdsa_context *ecdsa = ptr;
 
@@ -669,7 +2494,8 @@ static mrb_value mrb_ecdsa_load_pem(mrb_state *mrb, mrb_value self) {
   mbedtls_pk_init( &pkey );
 
   if (mrb_nil_p(obj)) {
-    ret = mbedtls_pk_parse_key_default_rng(&pkey, (const unsigned char *)RSTRING_PTR(pem), RSTRING_LEN(pem)+1, NULL, 0);
+    ret = mbedtls_pk_parse_key(&pkey, (const unsigned char *)RSTRING_PTR(pem), RSTRING_LEN(pem)+1, NULL, 0,
+                               mbedtls_ctr_drbg_random, mrb_pkey_rng(mrb));
   } else {
     ctr_drbg = DATA_CHECK_GET_PTR(mrb, obj, &mrb_ctr_drbg_type, mbedtls_ctr_drbg_context);
     ret = mbedtls_pk_parse_key(&pkey, (const unsigned char *)RSTRING_PTR(pem), RSTRING_LEN(pem)+1, NULL, 0,
@@ -779,6 +2605,488 @@ static mrb_value mrb_ecdsa_sign(mrb_state *mrb, mrb_value self) {
   }
 }
 
+#endif /* MBEDTLS_ECDSA_C && MBEDTLS_PK_PARSE_C */
+
+// PEM input must include the terminating NUL, DER must not. A chain with
+// any certificate mbedtls skipped (a positive count) is rejected as well.
+static int mrb_ca_chain_parse(mbedtls_x509_crt *chain, const unsigned char *data, size_t len) {
+  unsigned char *buf;
+  int ret;
+
+  if (mrb_ssl_memsearch(data, 0, len, "-----BEGIN ", 11) < 0) {
+    ret = mbedtls_x509_crt_parse(chain, data, len);
+  } else {
+    if ((buf = malloc(len + 1)) == NULL)
+      return MBEDTLS_ERR_X509_ALLOC_FAILED;
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+    ret = mbedtls_x509_crt_parse(chain, buf, len + 1);
+    free(buf);
+  }
+  return ret > 0 ? MBEDTLS_ERR_X509_INVALID_FORMAT : ret;
+}
+
+// PolarSSL::SSL::CAChain.new(pem_or_der)
+static mrb_value mrb_ca_chain_initialize(mrb_state *mrb, mrb_value self) {
+  mbedtls_x509_crt *chain;
+  mrb_value data;
+  int ret;
+
+  mrb_get_args(mrb, "S", &data);
+
+  chain = (mbedtls_x509_crt *) DATA_PTR(self);
+  if (chain) {
+    mrb_ca_chain_free(mrb, chain);
+  }
+  DATA_TYPE(self) = &mrb_ca_chain_type;
+  DATA_PTR(self) = NULL;
+
+  chain = (mbedtls_x509_crt *) mrb_malloc(mrb, sizeof(mbedtls_x509_crt));
+  mbedtls_x509_crt_init(chain);
+  DATA_PTR(self) = chain;
+
+  ret = mrb_ca_chain_parse(chain, (const unsigned char *) RSTRING_PTR(data), RSTRING_LEN(data));
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_SSL_ERROR, "E_SSL_ERROR", "mbedtls_x509_crt_parse()", ret);
+  return self;
+}
+
+static mrb_value mrb_ca_chain_size(mrb_state *mrb, mrb_value self) {
+  mbedtls_x509_crt *chain = DATA_CHECK_GET_PTR(mrb, self, &mrb_ca_chain_type, mbedtls_x509_crt);
+  mrb_int n = 0;
+
+  for (; chain != NULL && chain->raw.len > 0; chain = chain->next)
+    n++;
+  return mrb_fixnum_value(n);
+}
+
+#define E_PKEY_ERROR (mrb_class_get_under(mrb,mrb_module_get_under(mrb,mrb_module_get(mrb, "PolarSSL"),"PKey"), "Error"))
+
+// PolarSSL::PKey.rng, shared by PKey and ECDH
+static mbedtls_ctr_drbg_context *mrb_pkey_rng(mrb_state *mrb) {
+  struct RClass *pkey = mrb_module_get_under(mrb, mrb_module_get(mrb, "PolarSSL"), "PKey");
+  mrb_value rng = mrb_funcall(mrb, mrb_obj_value(pkey), "rng", 0);
+
+  return DATA_CHECK_GET_PTR(mrb, rng, &mrb_ctr_drbg_type, mbedtls_ctr_drbg_context);
+}
+
+#if defined(MBEDTLS_PK_PARSE_C)
+
+static mbedtls_md_type_t mrb_pkey_md_type(mrb_state *mrb, mrb_value name) {
+  const mbedtls_md_info_t *info;
+
+  if (mrb_nil_p(name))
+    return MBEDTLS_MD_SHA256;
+  info = mbedtls_md_info_from_string(mrb_string_value_cstr(mrb, &name));
+  if (info == NULL)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown digest %v", name);
+  return mbedtls_md_get_type(info);
+}
+
+// PolarSSL::PKey::PKey.new(pem_or_der, password = nil)
+// Tries a private key first, then a public key.
+static mrb_value mrb_pkey_initialize(mrb_state *mrb, mrb_value self) {
+  mbedtls_pk_context *pk;
+  mrb_value data, password = mrb_nil_value(), buf;
+  int ret;
+
+  mrb_get_args(mrb, "S|S!", &data, &password);
+
+  pk = (mbedtls_pk_context *) DATA_PTR(self);
+  if (pk) {
+    mrb_pkey_free(mrb, pk);
+  }
+  DATA_TYPE(self) = &mrb_pkey_type;
+  DATA_PTR(self) = NULL;
+
+  pk = (mbedtls_pk_context *) mrb_malloc(mrb, sizeof(mbedtls_pk_context));
+  mbedtls_pk_init(pk);
+  DATA_PTR(self) = pk;
+
+  // PEM input must include the terminating NUL, DER must not
+  buf = mrb_str_dup(mrb, data);
+  if (mrb_ssl_memsearch((const unsigned char *) RSTRING_PTR(data), 0, RSTRING_LEN(data), "-----BEGIN ", 11) >= 0)
+    mrb_str_cat(mrb, buf, "\0", 1);
+
+  ret = mbedtls_pk_parse_key(pk, (const unsigned char *) RSTRING_PTR(buf), RSTRING_LEN(buf),
+                             mrb_nil_p(password) ? NULL : (const unsigned char *) RSTRING_PTR(password),
+                             mrb_nil_p(password) ? 0 : RSTRING_LEN(password),
+                             mbedtls_ctr_drbg_random, mrb_pkey_rng(mrb));
+  if (ret != 0) {
+    mbedtls_pk_free(pk);
+    mbedtls_pk_init(pk);
+    if (mbedtls_pk_parse_public_key(pk, (const unsigned char *) RSTRING_PTR(buf), RSTRING_LEN(buf)) != 0)
+      mrb_raise_mbedtls_error(mrb, E_PKEY_ERROR, "E_PKEY_ERROR", "mbedtls_pk_parse_key()", ret);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@private"), mrb_false_value());
+  } else {
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@private"), mrb_true_value());
+  }
+  return self;
+}
+
+static mrb_value mrb_pkey_type_name(mrb_state *mrb, mrb_value self) {
+  mbedtls_pk_context *pk = DATA_CHECK_GET_PTR(mrb, self, &mrb_pkey_type, mbedtls_pk_context);
+  return mrb_str_new_cstr(mrb, mbedtls_pk_get_name(pk));
+}
+
+static mrb_value mrb_pkey_bits(mrb_state *mrb, mrb_value self) {
+  mbedtls_pk_context *pk = DATA_CHECK_GET_PTR(mrb, self, &mrb_pkey_type, mbedtls_pk_context);
+  return mrb_fixnum_value(mbedtls_pk_get_bitlen(pk));
+}
+
+// sign(hash, digest = "SHA256") => binary signature (PKCS#1 v1.5 or ASN.1 ECDSA)
+static mrb_value mrb_pkey_sign(mrb_state *mrb, mrb_value self) {
+  mbedtls_pk_context *pk;
+  mrb_value hash, md = mrb_nil_value();
+  unsigned char sig[MBEDTLS_PK_SIGNATURE_MAX_SIZE];
+  size_t sig_len = 0;
+  int ret;
+
+  mrb_get_args(mrb, "S|S!", &hash, &md);
+  pk = DATA_CHECK_GET_PTR(mrb, self, &mrb_pkey_type, mbedtls_pk_context);
+  if (!mrb_test(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@private"))))
+    mrb_raise(mrb, E_PKEY_ERROR, "sign requires a private key");
+
+  ret = mbedtls_pk_sign(pk, mrb_pkey_md_type(mrb, md),
+                        (const unsigned char *) RSTRING_PTR(hash), RSTRING_LEN(hash),
+                        sig, sizeof(sig), &sig_len, mbedtls_ctr_drbg_random, mrb_pkey_rng(mrb));
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_PKEY_ERROR, "E_PKEY_ERROR", "mbedtls_pk_sign()", ret);
+  return mrb_str_new(mrb, (char *) sig, sig_len);
+}
+
+// verify(hash, signature, digest = "SHA256") => true/false
+static mrb_value mrb_pkey_verify(mrb_state *mrb, mrb_value self) {
+  mbedtls_pk_context *pk;
+  mrb_value hash, sig, md = mrb_nil_value();
+
+  mrb_get_args(mrb, "SS|S!", &hash, &sig, &md);
+  pk = DATA_CHECK_GET_PTR(mrb, self, &mrb_pkey_type, mbedtls_pk_context);
+  return mrb_bool_value(mbedtls_pk_verify(pk, mrb_pkey_md_type(mrb, md),
+                                          (const unsigned char *) RSTRING_PTR(hash), RSTRING_LEN(hash),
+                                          (const unsigned char *) RSTRING_PTR(sig), RSTRING_LEN(sig)) == 0);
+}
+
+#if defined(MBEDTLS_PK_WRITE_C)
+static mrb_value mrb_pkey_public_to_der(mrb_state *mrb, mrb_value self) {
+  mbedtls_pk_context *pk;
+  unsigned char buf[2048];
+  int len;
+
+  pk = DATA_CHECK_GET_PTR(mrb, self, &mrb_pkey_type, mbedtls_pk_context);
+  // written at the end of the buffer
+  len = mbedtls_pk_write_pubkey_der(pk, buf, sizeof(buf));
+  if (len < 0)
+    mrb_raise_mbedtls_error(mrb, E_PKEY_ERROR, "E_PKEY_ERROR", "mbedtls_pk_write_pubkey_der()", len);
+  return mrb_str_new(mrb, (char *) buf + sizeof(buf) - len, len);
+}
+
+static mrb_value mrb_pkey_public_to_pem(mrb_state *mrb, mrb_value self) {
+  mbedtls_pk_context *pk;
+  unsigned char buf[4096];
+  int ret;
+
+  pk = DATA_CHECK_GET_PTR(mrb, self, &mrb_pkey_type, mbedtls_pk_context);
+  ret = mbedtls_pk_write_pubkey_pem(pk, buf, sizeof(buf));
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_PKEY_ERROR, "E_PKEY_ERROR", "mbedtls_pk_write_pubkey_pem()", ret);
+  return mrb_str_new_cstr(mrb, (char *) buf);
+}
+#endif
+#endif /* MBEDTLS_PK_PARSE_C */
+
+#if defined(MBEDTLS_ECDH_C)
+typedef struct mrb_ecdh {
+  mbedtls_ecp_group grp;
+  mbedtls_mpi d;        // our private key
+  mbedtls_ecp_point Q;  // our public key
+  int generated;
+} mrb_ecdh_t;
+
+static void mrb_ecdh_free(mrb_state *mrb, void *ptr) {
+  mrb_ecdh_t *ecdh = ptr;
+
+  if (ecdh != NULL) {
+    mbedtls_ecp_group_free(&ecdh->grp);
+    mbedtls_mpi_free(&ecdh->d);
+    mbedtls_ecp_point_free(&ecdh->Q);
+    mrb_free(mrb, ecdh);
+  }
+}
+
+static struct mrb_data_type mrb_ecdh_type = { "ECDH", mrb_ecdh_free };
+
+// PolarSSL::PKey::ECDH.new(curve = "x25519")
+// curve is an mbedtls curve name: "x25519", "secp256r1", "secp384r1", ...
+static mrb_value mrb_ecdh_initialize(mrb_state *mrb, mrb_value self) {
+  mrb_ecdh_t *ecdh;
+  const char *curve = "x25519";
+  const mbedtls_ecp_curve_info *info;
+  int ret;
+
+  mrb_get_args(mrb, "|z", &curve);
+
+  info = mbedtls_ecp_curve_info_from_name(curve);
+  if (info == NULL)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unsupported curve %s", curve);
+
+  ecdh = (mrb_ecdh_t *) DATA_PTR(self);
+  if (ecdh) {
+    mrb_ecdh_free(mrb, ecdh);
+  }
+  DATA_TYPE(self) = &mrb_ecdh_type;
+  DATA_PTR(self) = NULL;
+
+  ecdh = (mrb_ecdh_t *) mrb_malloc(mrb, sizeof(mrb_ecdh_t));
+  mbedtls_ecp_group_init(&ecdh->grp);
+  mbedtls_mpi_init(&ecdh->d);
+  mbedtls_ecp_point_init(&ecdh->Q);
+  ecdh->generated = 0;
+  DATA_PTR(self) = ecdh;
+
+  ret = mbedtls_ecp_group_load(&ecdh->grp, info->grp_id);
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_PKEY_ERROR, "E_PKEY_ERROR", "mbedtls_ecp_group_load()", ret);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@curve"), mrb_str_new_cstr(mrb, info->name));
+  return self;
+}
+
+// Creates a fresh key pair, replacing any previous one.
+static mrb_value mrb_ecdh_generate(mrb_state *mrb, mrb_value self) {
+  mrb_ecdh_t *ecdh = DATA_CHECK_GET_PTR(mrb, self, &mrb_ecdh_type, mrb_ecdh_t);
+  int ret;
+
+  ret = mbedtls_ecdh_gen_public(&ecdh->grp, &ecdh->d, &ecdh->Q, mbedtls_ctr_drbg_random, mrb_pkey_rng(mrb));
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_PKEY_ERROR, "E_PKEY_ERROR", "mbedtls_ecdh_gen_public()", ret);
+  ecdh->generated = 1;
+  return self;
+}
+
+static mrb_ecdh_t *mrb_ecdh_get_generated(mrb_state *mrb, mrb_value self) {
+  mrb_ecdh_t *ecdh = DATA_CHECK_GET_PTR(mrb, self, &mrb_ecdh_type, mrb_ecdh_t);
+
+  if (!ecdh->generated)
+    mrb_raise(mrb, E_PKEY_ERROR, "no key pair, call generate first");
+  return ecdh;
+}
+
+// Raw public key: 32 bytes for x25519, an uncompressed point (0x04 || X || Y)
+// for the short Weierstrass curves.
+static mrb_value mrb_ecdh_public_key(mrb_state *mrb, mrb_value self) {
+  mrb_ecdh_t *ecdh = mrb_ecdh_get_generated(mrb, self);
+  unsigned char buf[MBEDTLS_ECP_MAX_PT_LEN];
+  size_t olen;
+  int ret;
+
+  ret = mbedtls_ecp_point_write_binary(&ecdh->grp, &ecdh->Q, MBEDTLS_ECP_PF_UNCOMPRESSED,
+                                       &olen, buf, sizeof(buf));
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_PKEY_ERROR, "E_PKEY_ERROR", "mbedtls_ecp_point_write_binary()", ret);
+  return mrb_str_new(mrb, (char *) buf, olen);
+}
+
+// compute_shared(peer_public_key) => raw shared secret
+static mrb_value mrb_ecdh_compute_shared(mrb_state *mrb, mrb_value self) {
+  mrb_ecdh_t *ecdh;
+  mrb_value peer;
+  mbedtls_ecp_point Qp;
+  mbedtls_mpi z;
+  unsigned char buf[MBEDTLS_ECP_MAX_BYTES];
+  size_t len;
+  int ret;
+
+  mrb_get_args(mrb, "S", &peer);
+  ecdh = mrb_ecdh_get_generated(mrb, self);
+  len = (ecdh->grp.pbits + 7) / 8;
+
+  mbedtls_ecp_point_init(&Qp);
+  mbedtls_mpi_init(&z);
+  ret = mbedtls_ecp_point_read_binary(&ecdh->grp, &Qp, (const unsigned char *) RSTRING_PTR(peer), RSTRING_LEN(peer));
+  if (ret == 0)
+    ret = mbedtls_ecp_check_pubkey(&ecdh->grp, &Qp);
+  if (ret == 0)
+    ret = mbedtls_ecdh_compute_shared(&ecdh->grp, &z, &Qp, &ecdh->d, mbedtls_ctr_drbg_random, mrb_pkey_rng(mrb));
+  if (ret == 0) {
+    // RFC 7748 encodes x25519 secrets little-endian
+    if (mbedtls_ecp_get_type(&ecdh->grp) == MBEDTLS_ECP_TYPE_MONTGOMERY)
+      ret = mbedtls_mpi_write_binary_le(&z, buf, len);
+    else
+      ret = mbedtls_mpi_write_binary(&z, buf, len);
+  }
+  mbedtls_ecp_point_free(&Qp);
+  mbedtls_mpi_free(&z);
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_PKEY_ERROR, "E_PKEY_ERROR", "mbedtls_ecdh_compute_shared()", ret);
+
+  return mrb_str_new(mrb, (char *) buf, len);
+}
+#endif /* MBEDTLS_ECDH_C */
+
+#if defined(MBEDTLS_AES_C)
+#define E_CIPHER_ERROR (mrb_class_get_under(mrb,mrb_module_get(mrb, "PolarSSL"),"CipherError"))
+#define MRB_AES_GCM_TAG_LEN 16
+// chunks smaller than this aren't worth a thread hop
+#define MRB_AES_PARALLEL_MIN_CHUNK (64 * 1024)
+
+// Number of chunks for len bytes: 1 unless PolarSSL::Cipher.parallel_threshold
+// is set and len reaches it.
+static int mrb_aes_chunks(mrb_state *mrb, mrb_int len) {
+  struct RClass *cipher = mrb_class_get_under(mrb, mrb_module_get(mrb, "PolarSSL"), "Cipher");
+  mrb_value threshold = mrb_iv_get(mrb, mrb_obj_value(cipher), mrb_intern_lit(mrb, "@parallel_threshold"));
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  mrb_int chunks;
+
+  if (!mrb_fixnum_p(threshold) || len < mrb_fixnum(threshold))
+    return 1;
+  chunks = mrb_polarssl_pool_size() + 1;  // the calling thread takes one
+  if (chunks > len / MRB_AES_PARALLEL_MIN_CHUNK)
+    chunks = len / MRB_AES_PARALLEL_MIN_CHUNK;
+  return chunks < 1 ? 1 : (int) chunks;
+#else
+  (void) threshold;
+  return 1;
+#endif
+}
+
+// Serial path, straight mbedtls.
+static int mrb_aes_crypt_serial(enum mrb_polarssl_par_mode mode, int encrypt,
+                                const unsigned char *key, unsigned int keybits,
+                                const unsigned char *iv, size_t iv_len,
+                                const unsigned char *aad, size_t aad_len,
+                                const unsigned char *input, unsigned char *output, size_t len,
+                                unsigned char tag[MRB_AES_GCM_TAG_LEN]) {
+  mbedtls_aes_context aes;
+  unsigned char nonce_counter[16], stream_block[16];
+  size_t off, nc_off = 0;
+  int ret;
+
+  if (mode == MRB_POLARSSL_PAR_GCM) {
+#if defined(MBEDTLS_GCM_C)
+    mbedtls_gcm_context gcm;
+
+    mbedtls_gcm_init(&gcm);
+    ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, keybits);
+    if (ret == 0 && encrypt)
+      ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, len, iv, iv_len, aad, aad_len,
+                                      input, output, MRB_AES_GCM_TAG_LEN, tag);
+    else if (ret == 0)
+      ret = mbedtls_gcm_auth_decrypt(&gcm, len, iv, iv_len, aad, aad_len,
+                                     tag, MRB_AES_GCM_TAG_LEN, input, output);
+    mbedtls_gcm_free(&gcm);
+    return ret;
+#else
+    return MBEDTLS_ERR_AES_BAD_INPUT_DATA;  // mrb_aes_crypt rejects GCM first
+#endif
+  }
+
+  if (mode == MRB_POLARSSL_PAR_ECB && len % 16 != 0)
+    return MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH;
+  if (mode == MRB_POLARSSL_PAR_CTR && iv_len != 16)
+    return MBEDTLS_ERR_AES_BAD_INPUT_DATA;
+
+  mbedtls_aes_init(&aes);
+  if (mode == MRB_POLARSSL_PAR_ECB && !encrypt)
+    ret = mbedtls_aes_setkey_dec(&aes, key, keybits);
+  else
+    ret = mbedtls_aes_setkey_enc(&aes, key, keybits);
+  if (ret == 0 && mode == MRB_POLARSSL_PAR_ECB) {
+    for (off = 0; off < len && ret == 0; off += 16)
+      ret = mbedtls_aes_crypt_ecb(&aes, encrypt ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT,
+                                  input + off, output + off);
+  } else if (ret == 0) {
+#if defined(MBEDTLS_CIPHER_MODE_CTR)
+    memcpy(nonce_counter, iv, 16);
+    ret = mbedtls_aes_crypt_ctr(&aes, len, &nc_off, nonce_counter, stream_block, input, output);
+#else
+    (void) nonce_counter; (void) stream_block; (void) nc_off;
+    ret = MBEDTLS_ERR_AES_BAD_INPUT_DATA;  // mrb_aes_crypt rejects CTR first
+#endif
+  }
+  mbedtls_aes_free(&aes);
+  return ret;
+}
+
+// PolarSSL::Cipher::AES.encrypt(mode, key, source, iv, aad = nil)
+// PolarSSL::Cipher::AES.decrypt(mode, key, source, iv, aad = nil)
+// mode is "ECB", "CTR" or "GCM"; everything is binary. GCM output carries the
+// 16 byte tag at the end and decrypt expects it there.
+static mrb_value mrb_aes_crypt(mrb_state *mrb, int encrypt) {
+  mrb_value mode, key, source, iv, aad = mrb_nil_value(), out;
+  enum mrb_polarssl_par_mode m;
+  const char *mname;
+  unsigned char tag[MRB_AES_GCM_TAG_LEN];
+  mrb_int len;
+  int chunks, ret;
+
+  mrb_get_args(mrb, "SSSS|S!", &mode, &key, &source, &iv, &aad);
+
+  mname = mrb_string_value_cstr(mrb, &mode);
+  if (strcmp(mname, "ECB") == 0)
+    m = MRB_POLARSSL_PAR_ECB;
+  else if (strcmp(mname, "CTR") == 0)
+    m = MRB_POLARSSL_PAR_CTR;
+  else if (strcmp(mname, "GCM") == 0)
+    m = MRB_POLARSSL_PAR_GCM;
+  else
+    return mrb_nil_value();
+#if !defined(MBEDTLS_GCM_C)
+  if (m == MRB_POLARSSL_PAR_GCM)
+    mrb_raise(mrb, E_CIPHER_ERROR, "AES-GCM is not enabled in this build");
+#endif
+#if !defined(MBEDTLS_CIPHER_MODE_CTR)
+  if (m != MRB_POLARSSL_PAR_ECB)
+    mrb_raise(mrb, E_CIPHER_ERROR, "AES-CTR is not enabled in this build");
+#endif
+
+  if (RSTRING_LEN(key) != 16 && RSTRING_LEN(key) != 24 && RSTRING_LEN(key) != 32)
+    mrb_raise(mrb, E_CIPHER_ERROR, "AES key must be 16, 24 or 32 bytes");
+
+  len = RSTRING_LEN(source);
+  if (m == MRB_POLARSSL_PAR_GCM && !encrypt) {
+    if (len < MRB_AES_GCM_TAG_LEN)
+      mrb_raise(mrb, E_CIPHER_ERROR, "GCM input is shorter than its tag");
+    len -= MRB_AES_GCM_TAG_LEN;
+    memcpy(tag, RSTRING_PTR(source) + len, MRB_AES_GCM_TAG_LEN);
+  }
+
+  out = mrb_str_new(mrb, NULL, len + (m == MRB_POLARSSL_PAR_GCM && encrypt ? MRB_AES_GCM_TAG_LEN : 0));
+  chunks = mrb_aes_chunks(mrb, len);
+  // the chunked GCM derives counters from a 12 byte IV only
+  if (m == MRB_POLARSSL_PAR_GCM && RSTRING_LEN(iv) != 12)
+    chunks = 1;
+  if (chunks > 1)
+    ret = mrb_polarssl_aes_parallel(m, encrypt, (unsigned char *) RSTRING_PTR(key), RSTRING_LEN(key) * 8,
+                                    (unsigned char *) RSTRING_PTR(iv), RSTRING_LEN(iv),
+                                    mrb_nil_p(aad) ? NULL : (unsigned char *) RSTRING_PTR(aad),
+                                    mrb_nil_p(aad) ? 0 : RSTRING_LEN(aad),
+                                    (unsigned char *) RSTRING_PTR(source), (unsigned char *) RSTRING_PTR(out),
+                                    len, tag, chunks);
+  else
+    ret = mrb_aes_crypt_serial(m, encrypt, (unsigned char *) RSTRING_PTR(key), RSTRING_LEN(key) * 8,
+                               (unsigned char *) RSTRING_PTR(iv), RSTRING_LEN(iv),
+                               mrb_nil_p(aad) ? NULL : (unsigned char *) RSTRING_PTR(aad),
+                               mrb_nil_p(aad) ? 0 : RSTRING_LEN(aad),
+                               (unsigned char *) RSTRING_PTR(source), (unsigned char *) RSTRING_PTR(out),
+                               len, tag);
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_CIPHER_ERROR, "CipherError", "AES", ret);
+
+  if (m == MRB_POLARSSL_PAR_GCM && encrypt)
+    memcpy(RSTRING_PTR(out) + len, tag, MRB_AES_GCM_TAG_LEN);
+  return out;
+}
+
+static mrb_value mrb_aes_encrypt(mrb_state *mrb, mrb_value self) {
+  return mrb_aes_crypt(mrb, 1);
+}
+
+static mrb_value mrb_aes_decrypt(mrb_state *mrb, mrb_value self) {
+  return mrb_aes_crypt(mrb, 0);
+}
+#endif /* MBEDTLS_AES_C */
+
+#if defined(MBEDTLS_DES_C)
 static mrb_value mrb_des_encrypt(mrb_state *mrb, mrb_value self) {
   mrb_value mode, key, source, iv;
   unsigned char output[100];
@@ -907,6 +3215,8 @@ static mrb_value mrb_des3_decrypt(mrb_state *mrb, mrb_value self) {
   return mrb_str_new(mrb, (char *)&output, len);
 }
 
+#endif /* MBEDTLS_DES_C */
+
 static mrb_value mrb_base64_encode(mrb_state *mrb, mrb_value self) {
   mrb_value src;
   size_t len;
@@ -937,21 +3247,424 @@ static mrb_value mrb_base64_decode(mrb_state *mrb, mrb_value self) {
   return mrb_str_new(mrb, (char *)&buffer, len);
 }
 
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+static mrb_value mrb_polarssl_memory_stats(mrb_state *mrb, mrb_value self) {
+  mrb_polarssl_mem_stats stats;
+  mrb_value hash = mrb_hash_new(mrb);
+
+  mrb_polarssl_mem_get_stats(&stats);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "current")), mrb_fixnum_value(stats.current));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "peak")), mrb_fixnum_value(stats.peak));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "allocations")), mrb_fixnum_value(stats.allocations));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "cached")), mrb_fixnum_value(stats.cached));
+  return hash;
+}
+
+static mrb_value mrb_polarssl_set_memory_pool(mrb_state *mrb, mrb_value self) {
+  mrb_bool enabled;
+
+  mrb_get_args(mrb, "b", &enabled);
+  mrb_polarssl_mem_set_pooling(enabled);
+  return mrb_bool_value(enabled);
+}
+
+static mrb_value mrb_polarssl_memory_pool(mrb_state *mrb, mrb_value self) {
+  return mrb_bool_value(mrb_polarssl_mem_pooling());
+}
+#endif
+
 static mrb_value mrb_mbedtls_set_debug_threshold(mrb_state *mrb, mrb_value self) {
   mrb_int threshold = 0;
+#if defined(MBEDTLS_DEBUG_C)
+  mrb_value old = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@debug_threshold"));
+#endif
   mrb_get_args(mrb, "i", &threshold);
-  mbedtls_debug_set_threshold(threshold);
+#if defined(MBEDTLS_DEBUG_C)
+  mbedtls_debug_set_threshold(mrb_polarssl_shared_debug_threshold(
+      mrb_fixnum_p(old) ? (int) mrb_fixnum(old) : 0, (int) threshold));
+#endif
   mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@debug_threshold"), mrb_fixnum_value(threshold));
   return self;
 }
 
+#ifdef MRUBY_POLARSSL_THREADING
+/*
+ * PolarSSL::Shared: objects built once per process and used from every VM
+ * (one per thread) that asks for the same name. The wrappers are ordinary
+ * CtrDrbg, SSL::CAChain, PKey::PKey, ... objects and the native object is
+ * destroyed with the last of them. Everything is allocated with malloc,
+ * not mrb_malloc, since it outlives the VM that built it.
+ */
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  const unsigned char *pw;
+  size_t pw_len;
+  mrb_int n1;
+  mrb_int n2;
+  mbedtls_ctr_drbg_context *rng;
+} mrb_shared_args;
+
+static mrb_value mrb_shared_wrap(mrb_state *mrb, mrb_value name, struct RClass *cls,
+                                 const struct mrb_data_type *type, const mrb_polarssl_shared_kind *kind,
+                                 int (*create)(void *arg, void **ptr), mrb_shared_args *args) {
+  // allocated first so raising can't leak a reference
+  struct RData *obj = mrb_data_object_alloc(mrb, cls, NULL, type);
+  void *ptr = NULL;
+  int ret;
+
+  ret = mrb_polarssl_shared_acquire(mrb_string_value_cstr(mrb, &name), kind, create, args, &ptr);
+  if (ret == MRB_POLARSSL_SHARED_MISSING)
+    mrb_raisef(mrb, E_KEY_ERROR, "no shared %s named %v", kind->name, name);
+  if (ret == MRB_POLARSSL_SHARED_WRONG_KIND)
+    mrb_raisef(mrb, E_TYPE_ERROR, "shared object %v is not a %s", name, kind->name);
+  if (ret == MRB_POLARSSL_SHARED_NO_MEMORY)
+    mrb_raise(mrb, E_MALLOC_FAILED, "could not allocate shared object");
+  if (ret != 0)
+    mrb_raise_mbedtls_error(mrb, E_RUNTIME_ERROR, "error", kind->name, ret);
+  obj->data = ptr;
+  return mrb_obj_value(obj);
+}
+
+typedef struct {
+  mbedtls_ctr_drbg_context drbg;  // first, so the pointer is also a plain DRBG
+  mbedtls_entropy_context entropy;
+} mrb_shared_drbg_t;
+
+static void mrb_shared_drbg_destroy(void *ptr) {
+  mrb_shared_drbg_t *d = ptr;
+
+  mbedtls_ctr_drbg_free(&d->drbg);
+  mbedtls_entropy_free(&d->entropy);
+  free(d);
+}
+
+static const mrb_polarssl_shared_kind mrb_shared_drbg_kind = { "CtrDrbg", mrb_shared_drbg_destroy };
+
+static int mrb_shared_drbg_create(void *arg, void **ptr) {
+  mrb_shared_args *args = arg;
+  mrb_shared_drbg_t *d;
+  int ret;
+
+  if ((d = calloc(1, sizeof(mrb_shared_drbg_t))) == NULL)
+    return MRB_POLARSSL_SHARED_NO_MEMORY;
+  mbedtls_entropy_init(&d->entropy);
+  mbedtls_ctr_drbg_init(&d->drbg);
+  ret = mbedtls_ctr_drbg_seed(&d->drbg, mbedtls_entropy_func, &d->entropy, args->data, args->len);
+  if (ret != 0) {
+    mrb_shared_drbg_destroy(d);
+    return ret;
+  }
+  *ptr = d;
+  return 0;
+}
+
+// PolarSSL::Shared.ctr_drbg(name, pers = nil)
+// mbedtls_ctr_drbg_random locks the context, so one generator serves all VMs.
+static mrb_value mrb_shared_ctr_drbg(mrb_state *mrb, mrb_value self) {
+  mrb_value name, pers = mrb_nil_value();
+  mrb_shared_args args;
+
+  mrb_get_args(mrb, "S|S!", &name, &pers);
+  memset(&args, 0, sizeof(args));
+  if (!mrb_nil_p(pers)) {
+    args.data = (const unsigned char *) RSTRING_PTR(pers);
+    args.len = RSTRING_LEN(pers);
+  }
+  return mrb_shared_wrap(mrb, name, mrb_class_get_under(mrb, mrb_module_get(mrb, "PolarSSL"), "CtrDrbg"),
+                         &mrb_ctr_drbg_type, &mrb_shared_drbg_kind, mrb_shared_drbg_create, &args);
+}
+
+static void mrb_shared_ca_chain_destroy(void *ptr) {
+  mbedtls_x509_crt_free(ptr);
+  free(ptr);
+}
+
+static const mrb_polarssl_shared_kind mrb_shared_ca_chain_kind = { "SSL::CAChain", mrb_shared_ca_chain_destroy };
+
+static int mrb_shared_ca_chain_create(void *arg, void **ptr) {
+  mrb_shared_args *args = arg;
+  mbedtls_x509_crt *chain;
+  int ret;
+
+  if ((chain = malloc(sizeof(mbedtls_x509_crt))) == NULL)
+    return MRB_POLARSSL_SHARED_NO_MEMORY;
+  mbedtls_x509_crt_init(chain);
+  if ((ret = mrb_ca_chain_parse(chain, args->data, args->len)) != 0) {
+    mrb_shared_ca_chain_destroy(chain);
+    return ret;
+  }
+  *ptr = chain;
+  return 0;
+}
+
+// PolarSSL::Shared.ca_chain(name, pem_or_der = nil)
+// Verification only reads the chain. Without data the name must exist.
+static mrb_value mrb_shared_ca_chain(mrb_state *mrb, mrb_value self) {
+  mrb_value name, data = mrb_nil_value();
+  mrb_shared_args args;
+
+  mrb_get_args(mrb, "S|S!", &name, &data);
+  memset(&args, 0, sizeof(args));
+  if (!mrb_nil_p(data)) {
+    args.data = (const unsigned char *) RSTRING_PTR(data);
+    args.len = RSTRING_LEN(data);
+  }
+  return mrb_shared_wrap(mrb, name,
+                         mrb_class_get_under(mrb, mrb_class_get_under(mrb, mrb_module_get(mrb, "PolarSSL"), "SSL"), "CAChain"),
+                         &mrb_ca_chain_type, &mrb_shared_ca_chain_kind,
+                         mrb_nil_p(data) ? NULL : mrb_shared_ca_chain_create, &args);
+}
+
+#if defined(MBEDTLS_PK_PARSE_C)
+typedef struct {
+  mbedtls_pk_context pk;  // first, so the pointer is also a plain pk context
+  mrb_bool priv;
+} mrb_shared_pkey_t;
+
+static void mrb_shared_pkey_destroy(void *ptr) {
+  mbedtls_pk_free(ptr);
+  free(ptr);
+}
+
+static const mrb_polarssl_shared_kind mrb_shared_pkey_kind = { "PKey::PKey", mrb_shared_pkey_destroy };
+
+static int mrb_shared_pkey_create(void *arg, void **ptr) {
+  mrb_shared_args *args = arg;
+  mrb_shared_pkey_t *key;
+  unsigned char *buf;
+  size_t len = args->len;
+  int ret;
+
+  if ((key = calloc(1, sizeof(mrb_shared_pkey_t))) == NULL)
+    return MRB_POLARSSL_SHARED_NO_MEMORY;
+  if ((buf = malloc(len + 1)) == NULL) {
+    free(key);
+    return MRB_POLARSSL_SHARED_NO_MEMORY;
+  }
+  // PEM input must include the terminating NUL, DER must not
+  memcpy(buf, args->data, len);
+  if (mrb_ssl_memsearch(args->data, 0, args->len, "-----BEGIN ", 11) >= 0)
+    buf[len++] = '\0';
+
+  mbedtls_pk_init(&key->pk);
+  ret = mbedtls_pk_parse_key(&key->pk, buf, len, args->pw, args->pw_len, mbedtls_ctr_drbg_random, args->rng);
+  key->priv = ret == 0;
+  if (ret != 0) {
+    mbedtls_pk_free(&key->pk);
+    mbedtls_pk_init(&key->pk);
+    if (mbedtls_pk_parse_public_key(&key->pk, buf, len) == 0)
+      ret = 0;
+  }
+  free(buf);
+  if (ret != 0) {
+    mrb_shared_pkey_destroy(key);
+    return ret;
+  }
+  *ptr = key;
+  return 0;
+}
+
+// PolarSSL::Shared.pkey(name, pem_or_der = nil, password = nil)
+// RSA operations lock the key when mbedtls is built with threading, ECDSA
+// ones only read it.
+static mrb_value mrb_shared_pkey(mrb_state *mrb, mrb_value self) {
+  mrb_value name, data = mrb_nil_value(), password = mrb_nil_value(), key;
+  mrb_shared_args args;
+
+  mrb_get_args(mrb, "S|S!S!", &name, &data, &password);
+  memset(&args, 0, sizeof(args));
+  if (!mrb_nil_p(data)) {
+    args.data = (const unsigned char *) RSTRING_PTR(data);
+    args.len = RSTRING_LEN(data);
+    args.rng = mrb_pkey_rng(mrb);
+  }
+  if (!mrb_nil_p(password)) {
+    args.pw = (const unsigned char *) RSTRING_PTR(password);
+    args.pw_len = RSTRING_LEN(password);
+  }
+  key = mrb_shared_wrap(mrb, name,
+                        mrb_class_get_under(mrb, mrb_module_get_under(mrb, mrb_module_get(mrb, "PolarSSL"), "PKey"), "PKey"),
+                        &mrb_pkey_type, &mrb_shared_pkey_kind,
+                        mrb_nil_p(data) ? NULL : mrb_shared_pkey_create, &args);
+  mrb_iv_set(mrb, key, mrb_intern_lit(mrb, "@private"),
+             mrb_bool_value(((mrb_shared_pkey_t *) DATA_PTR(key))->priv));
+  return key;
+}
+#endif
+
+#ifdef MRB_SSL_VERIFY_CACHE
+static void mrb_shared_vcache_destroy(void *ptr) {
+  mrb_ssl_vcache_t *vc = ptr;
+
+  pthread_mutex_destroy(&vc->lock);
+  free(vc->entries);
+  free(vc);
+}
+
+static const mrb_polarssl_shared_kind mrb_shared_vcache_kind = { "SSL::VerifyCache", mrb_shared_vcache_destroy };
+
+static int mrb_shared_vcache_create(void *arg, void **ptr) {
+  mrb_shared_args *args = arg;
+  mrb_ssl_vcache_t *vc;
+
+  if ((vc = calloc(1, sizeof(mrb_ssl_vcache_t))) == NULL)
+    return MRB_POLARSSL_SHARED_NO_MEMORY;
+  if ((vc->entries = calloc(args->n1, sizeof(mrb_ssl_vcache_entry))) == NULL) {
+    free(vc);
+    return MRB_POLARSSL_SHARED_NO_MEMORY;
+  }
+  vc->capa = args->n1;
+  vc->ttl = args->n2;
+  pthread_mutex_init(&vc->lock, NULL);
+  *ptr = vc;
+  return 0;
+}
+
+// PolarSSL::Shared.verify_cache(name, max_entries = 64, ttl = 3600)
+static mrb_value mrb_shared_verify_cache(mrb_state *mrb, mrb_value self) {
+  mrb_value name;
+  mrb_shared_args args;
+
+  memset(&args, 0, sizeof(args));
+  args.n1 = 64;
+  args.n2 = 3600;
+  mrb_get_args(mrb, "S|ii", &name, &args.n1, &args.n2);
+  if (args.n1 <= 0 || args.n2 < 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_entries must be positive and ttl not negative");
+  return mrb_shared_wrap(mrb, name,
+                         mrb_class_get_under(mrb, mrb_class_get_under(mrb, mrb_module_get(mrb, "PolarSSL"), "SSL"), "VerifyCache"),
+                         &mrb_ssl_vcache_type, &mrb_shared_vcache_kind, mrb_shared_vcache_create, &args);
+}
+#endif
+
+#ifdef MRB_SSL_SESSION_CACHE
+static void mrb_shared_session_cache_destroy(void *ptr) {
+  mbedtls_ssl_cache_free(ptr);
+  free(ptr);
+}
+
+static const mrb_polarssl_shared_kind mrb_shared_session_cache_kind = { "SSL::SessionCache", mrb_shared_session_cache_destroy };
+
+static int mrb_shared_session_cache_create(void *arg, void **ptr) {
+  mrb_shared_args *args = arg;
+  mbedtls_ssl_cache_context *cache;
+
+  if ((cache = malloc(sizeof(mbedtls_ssl_cache_context))) == NULL)
+    return MRB_POLARSSL_SHARED_NO_MEMORY;
+  mrb_session_cache_setup(cache, args->n1, args->n2);
+  *ptr = cache;
+  return 0;
+}
+
+// PolarSSL::Shared.session_cache(name, max_entries = 50, timeout = 86400)
+// A session resumes on whichever VM's server accepts the reconnect.
+static mrb_value mrb_shared_session_cache(mrb_state *mrb, mrb_value self) {
+  mrb_value name;
+  mrb_shared_args args;
+
+  memset(&args, 0, sizeof(args));
+  args.n1 = MBEDTLS_SSL_CACHE_DEFAULT_MAX_ENTRIES;
+  args.n2 = MBEDTLS_SSL_CACHE_DEFAULT_TIMEOUT;
+  mrb_get_args(mrb, "S|ii", &name, &args.n1, &args.n2);
+  if (args.n1 <= 0 || args.n2 < 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_entries must be positive and timeout not negative");
+  return mrb_shared_wrap(mrb, name,
+                         mrb_class_get_under(mrb, mrb_class_get_under(mrb, mrb_module_get(mrb, "PolarSSL"), "SSL"), "SessionCache"),
+                         &mrb_session_cache_type, &mrb_shared_session_cache_kind, mrb_shared_session_cache_create, &args);
+}
+#endif
+
+static mrb_value mrb_shared_include_p(mrb_state *mrb, mrb_value self) {
+  const char *name;
+
+  mrb_get_args(mrb, "z", &name);
+  return mrb_bool_value(mrb_polarssl_shared_kind_of(name) != NULL);
+}
+#endif /* MRUBY_POLARSSL_THREADING */
+
+// Optional parts of the API, depending on the mbedtls configuration the gem
+// was built with (see polarssl_profile in mrbgem.rake).
+static mrb_value mrb_polarssl_features(mrb_state *mrb) {
+  mrb_value features = mrb_ary_new(mrb);
+
+#if defined(MBEDTLS_AES_C)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "aes"));
+#endif
+#if defined(MBEDTLS_DES_C)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "des"));
+#endif
+#if defined(MBEDTLS_PK_PARSE_C)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "pkey"));
+#endif
+#if defined(MBEDTLS_ECDSA_C) && defined(MBEDTLS_PK_PARSE_C)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "ecdsa"));
+#endif
+#if defined(MBEDTLS_ECDH_C)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "ecdh"));
+#endif
+#if defined(MBEDTLS_DEBUG_C)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "debug"));
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_2)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "tls1_2"));
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "tls1_3"));
+#endif
+#if defined(MBEDTLS_SSL_PROTO_DTLS) && defined(MBEDTLS_TIMING_C)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "dtls"));
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "dtls_cid"));
+#endif
+#ifdef MRB_SSL_VERIFY_CACHE
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "verify_cache"));
+#endif
+#ifdef MRB_SSL_SESSION_CACHE
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "session_cache"));
+#endif
+#if defined(MBEDTLS_AESNI_C)
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "aesni"));
+#endif
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "threads"));
+#endif
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "allocator"));
+#endif
+#ifdef MRUBY_POLARSSL_THREADING
+  mrb_ary_push(mrb, features, mrb_str_new_lit(mrb, "threading"));
+#endif
+  return features;
+}
+
 void mrb_mruby_polarssl_gem_init(mrb_state *mrb) {
-  struct RClass *p, *e, *c, *s, *pkey, *ecdsa, *cipher, *des, *des3, *base64;
+  struct RClass *p, *e, *c, *s, *vcache, *cachain, *scache, *shared, *pkey, *pk, *ecdsa, *ecdh, *cipher, *des, *des3, *aes, *base64;
+
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+  mrb_polarssl_mem_install();
+#endif
+#if defined(MBEDTLS_PSA_CRYPTO_C)
+  // TLS 1.3 and PSA backed primitives fail until this ran; it is idempotent
+  psa_crypto_init();
+#endif
 
   p = mrb_define_module(mrb, "PolarSSL");
   pkey = mrb_define_module_under(mrb, p, "PKey");
 
   mrb_define_class_method(mrb, p, "debug_threshold=", mrb_mbedtls_set_debug_threshold, MRB_ARGS_REQ(1));
+  mrb_define_const(mrb, p, "FEATURES", mrb_polarssl_features(mrb));
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+  mrb_define_class_method(mrb, p, "memory_stats", mrb_polarssl_memory_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, p, "memory_pool", mrb_polarssl_memory_pool, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, p, "memory_pool=", mrb_polarssl_set_memory_pool, MRB_ARGS_REQ(1));
+#endif
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  mrb_define_class_method(mrb, p, "worker_threads", mrb_polarssl_worker_threads, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, p, "worker_threads=", mrb_polarssl_set_worker_threads, MRB_ARGS_REQ(1));
+#endif
 
   #ifdef MRUBY_MBEDTLS_DEBUG_C
     mrb_funcall(mrb, p, "debug_threshold=", 1, mrb_fixnum_value(5));
@@ -961,12 +3674,19 @@ void mrb_mruby_polarssl_gem_init(mrb_state *mrb) {
   MRB_SET_INSTANCE_TT(e, MRB_TT_DATA);
   mrb_define_method(mrb, e, "initialize", mrb_entropy_initialize, MRB_ARGS_NONE());
   mrb_define_method(mrb, e, "gather", mrb_entropy_gather, MRB_ARGS_NONE());
+#if defined(MBEDTLS_FS_IO)
+  mrb_define_method(mrb, e, "load_seed_file", mrb_entropy_load_seed_file, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, e, "update_seed_file", mrb_entropy_update_seed_file, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, e, "write_seed_file", mrb_entropy_write_seed_file, MRB_ARGS_REQ(1));
+#endif
 
   c = mrb_define_class_under(mrb, p, "CtrDrbg", mrb->object_class);
   MRB_SET_INSTANCE_TT(c, MRB_TT_DATA);
   mrb_define_method(mrb, c, "initialize", mrb_ctrdrbg_initialize, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
   mrb_define_method(mrb, c, "random_bytes", mrb_ctrdrbg_random_bytes, MRB_ARGS_REQ(1));
+#if defined(MBEDTLS_SELF_TEST)
   mrb_define_singleton_method(mrb, (struct RObject*)c, "self_test", mrb_ctrdrbg_self_test, MRB_ARGS_NONE());
+#endif
 
   s = mrb_define_class_under(mrb, p, "SSL", mrb->object_class);
   MRB_SET_INSTANCE_TT(s, MRB_TT_DATA);
@@ -983,17 +3703,66 @@ void mrb_mruby_polarssl_gem_init(mrb_state *mrb) {
   mrb_define_method(mrb, s, "set_authmode", mrb_ssl_set_authmode, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, s, "set_rng", mrb_ssl_set_rng, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, s, "set_socket", mrb_ssl_set_socket, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, s, "set_memory_bio", mrb_ssl_set_memory_bio, MRB_ARGS_NONE());
+  mrb_define_method(mrb, s, "set_bio_callbacks", mrb_ssl_set_bio_callbacks, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, s, "feed", mrb_ssl_feed, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, s, "drain", mrb_ssl_drain, MRB_ARGS_NONE());
+  mrb_define_method(mrb, s, "pending_output", mrb_ssl_pending_output, MRB_ARGS_NONE());
   mrb_define_method(mrb, s, "set_hostname", mrb_ssl_set_hostname, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, s, "handshake", mrb_ssl_handshake, MRB_ARGS_NONE());
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+  mrb_define_method(mrb, s, "handshake_async", mrb_ssl_handshake_async, MRB_ARGS_NONE());
+  mrb_define_method(mrb, s, "handshake_done?", mrb_ssl_handshake_done_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, s, "handshake_wait", mrb_ssl_handshake_wait, MRB_ARGS_NONE());
+  mrb_define_method(mrb, s, "handshake_fd", mrb_ssl_handshake_fd, MRB_ARGS_NONE());
+#endif
   mrb_define_method(mrb, s, "write", mrb_ssl_write, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, s, "write_file", mrb_ssl_write_file, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(2, 0));
+  mrb_define_method(mrb, s, "flush", mrb_ssl_flush, MRB_ARGS_NONE());
   mrb_define_method(mrb, s, "read", mrb_ssl_read, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, s, "gets", mrb_ssl_gets, MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, s, "read_until", mrb_ssl_read_until, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, s, "read_exactly", mrb_ssl_read_exactly, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, s, "bytes_available", mrb_ssl_bytes_available, MRB_ARGS_NONE());
+  mrb_define_method(mrb, s, "wait_readable", mrb_ssl_wait_readable, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, s, "wait_writable", mrb_ssl_wait_writable, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, s, "alive?", mrb_ssl_alive_p, MRB_ARGS_NONE());
+#ifdef MRUBY_POLARSSL_ALLOCATOR
+  mrb_define_method(mrb, s, "memory_usage", mrb_ssl_memory_usage, MRB_ARGS_NONE());
+  mrb_define_method(mrb, s, "memory_peak", mrb_ssl_memory_peak, MRB_ARGS_NONE());
+#endif
+  mrb_define_method(mrb, s, "datagram?", mrb_ssl_datagram_p, MRB_ARGS_NONE());
+#ifdef MRB_SSL_VERIFY_CACHE
+  vcache = mrb_define_class_under(mrb, s, "VerifyCache", mrb->object_class);
+  MRB_SET_INSTANCE_TT(vcache, MRB_TT_DATA);
+  mrb_define_method(mrb, vcache, "initialize", mrb_ssl_vcache_initialize, MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, vcache, "size", mrb_ssl_vcache_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, vcache, "clear", mrb_ssl_vcache_clear, MRB_ARGS_NONE());
+  mrb_define_method(mrb, vcache, "hits", mrb_ssl_vcache_hits, MRB_ARGS_NONE());
+  mrb_define_method(mrb, vcache, "misses", mrb_ssl_vcache_misses, MRB_ARGS_NONE());
+#endif
+  cachain = mrb_define_class_under(mrb, s, "CAChain", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cachain, MRB_TT_DATA);
+  mrb_define_method(mrb, cachain, "initialize", mrb_ca_chain_initialize, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cachain, "size", mrb_ca_chain_size, MRB_ARGS_NONE());
+#ifdef MRB_SSL_SESSION_CACHE
+  scache = mrb_define_class_under(mrb, s, "SessionCache", mrb->object_class);
+  MRB_SET_INSTANCE_TT(scache, MRB_TT_DATA);
+  mrb_define_method(mrb, scache, "initialize", mrb_session_cache_initialize, MRB_ARGS_OPT(2));
+#endif
+#if defined(MBEDTLS_SSL_DTLS_HELLO_VERIFY) && defined(MBEDTLS_SSL_COOKIE_C)
+  mrb_define_method(mrb, s, "client_id=", mrb_ssl_set_client_id, MRB_ARGS_REQ(1));
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+  mrb_define_method(mrb, s, "peer_connection_id", mrb_ssl_peer_connection_id, MRB_ARGS_NONE());
+#endif
   mrb_define_method(mrb, s, "fileno", mrb_ssl_fileno, MRB_ARGS_NONE());
   mrb_define_method(mrb, s, "close_notify", mrb_ssl_close_notify, MRB_ARGS_NONE());
   mrb_define_method(mrb, s, "close", mrb_ssl_close, MRB_ARGS_NONE());
   mrb_define_method(mrb, s, "blocking=", mrb_ssl_set_blocking, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, s, "read_timeout=", mrb_ssl_set_read_timeout, MRB_ARGS_REQ(1));
 
+#if defined(MBEDTLS_ECDSA_C) && defined(MBEDTLS_PK_PARSE_C)
   ecdsa = mrb_define_class_under(mrb, pkey, "EC", mrb->object_class);
   MRB_SET_INSTANCE_TT(ecdsa, MRB_TT_DATA);
   mrb_define_method(mrb, ecdsa, "alloc", mrb_ecdsa_alloc, MRB_ARGS_NONE());
@@ -1002,9 +3771,50 @@ void mrb_mruby_polarssl_gem_init(mrb_state *mrb) {
   mrb_define_method(mrb, ecdsa, "public_key", mrb_ecdsa_public_key, MRB_ARGS_NONE());
   mrb_define_method(mrb, ecdsa, "private_key", mrb_ecdsa_private_key, MRB_ARGS_NONE());
   mrb_define_method(mrb, ecdsa, "sign", mrb_ecdsa_sign, MRB_ARGS_REQ(1));
+#endif
+
+#if defined(MBEDTLS_PK_PARSE_C)
+  pk = mrb_define_class_under(mrb, pkey, "PKey", mrb->object_class);
+  MRB_SET_INSTANCE_TT(pk, MRB_TT_DATA);
+  mrb_define_method(mrb, pk, "initialize", mrb_pkey_initialize, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, pk, "type", mrb_pkey_type_name, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pk, "bits", mrb_pkey_bits, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pk, "sign", mrb_pkey_sign, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, pk, "verify", mrb_pkey_verify, MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1));
+#if defined(MBEDTLS_PK_WRITE_C)
+  mrb_define_method(mrb, pk, "public_to_der", mrb_pkey_public_to_der, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pk, "public_to_pem", mrb_pkey_public_to_pem, MRB_ARGS_NONE());
+#endif
+#endif
+
+#if defined(MBEDTLS_ECDH_C)
+  ecdh = mrb_define_class_under(mrb, pkey, "ECDH", mrb->object_class);
+  MRB_SET_INSTANCE_TT(ecdh, MRB_TT_DATA);
+  mrb_define_method(mrb, ecdh, "initialize", mrb_ecdh_initialize, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ecdh, "generate", mrb_ecdh_generate, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ecdh, "public_key", mrb_ecdh_public_key, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ecdh, "compute_shared", mrb_ecdh_compute_shared, MRB_ARGS_REQ(1));
+#endif
+
+#ifdef MRUBY_POLARSSL_THREADING
+  shared = mrb_define_module_under(mrb, p, "Shared");
+  mrb_define_class_method(mrb, shared, "ctr_drbg", mrb_shared_ctr_drbg, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, shared, "ca_chain", mrb_shared_ca_chain, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+#if defined(MBEDTLS_PK_PARSE_C)
+  mrb_define_class_method(mrb, shared, "pkey", mrb_shared_pkey, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+#endif
+#ifdef MRB_SSL_VERIFY_CACHE
+  mrb_define_class_method(mrb, shared, "verify_cache", mrb_shared_verify_cache, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+#endif
+#ifdef MRB_SSL_SESSION_CACHE
+  mrb_define_class_method(mrb, shared, "session_cache", mrb_shared_session_cache, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+#endif
+  mrb_define_class_method(mrb, shared, "include?", mrb_shared_include_p, MRB_ARGS_REQ(1));
+#endif
 
   cipher = mrb_define_class_under(mrb, p, "Cipher", mrb->object_class);
 
+#if defined(MBEDTLS_DES_C)
   des = mrb_define_class_under(mrb, cipher, "DES", cipher);
   mrb_define_class_method(mrb, des, "encrypt", mrb_des_encrypt, MRB_ARGS_REQ(4));
   mrb_define_class_method(mrb, des, "decrypt", mrb_des_decrypt, MRB_ARGS_REQ(4));
@@ -1012,6 +3822,13 @@ void mrb_mruby_polarssl_gem_init(mrb_state *mrb) {
   des3 = mrb_define_class_under(mrb, cipher, "DES3", cipher);
   mrb_define_class_method(mrb, des3, "encrypt", mrb_des3_encrypt, MRB_ARGS_REQ(4));
   mrb_define_class_method(mrb, des3, "decrypt", mrb_des3_decrypt, MRB_ARGS_REQ(4));
+#endif
+
+#if defined(MBEDTLS_AES_C)
+  aes = mrb_define_class_under(mrb, cipher, "AES", cipher);
+  mrb_define_class_method(mrb, aes, "encrypt", mrb_aes_encrypt, MRB_ARGS_REQ(4) | MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, aes, "decrypt", mrb_aes_decrypt, MRB_ARGS_REQ(4) | MRB_ARGS_OPT(1));
+#endif
 
   base64 = mrb_define_module_under(mrb, p, "Base64");
   mrb_define_class_method(mrb, base64, "encode", mrb_base64_encode, MRB_ARGS_REQ(1));
@@ -1019,5 +3836,13 @@ void mrb_mruby_polarssl_gem_init(mrb_state *mrb) {
 }
 
 void mrb_mruby_polarssl_gem_final(mrb_state *mrb) {
+#if defined(MBEDTLS_DEBUG_C)
+  // withdraw this VM's debug level so the others' applies again
+  mrb_value threshold = mrb_iv_get(mrb, mrb_obj_value(mrb_module_get(mrb, "PolarSSL")),
+                                   mrb_intern_lit(mrb, "@debug_threshold"));
+
+  if (mrb_fixnum_p(threshold))
+    mbedtls_debug_set_threshold(mrb_polarssl_shared_debug_threshold((int) mrb_fixnum(threshold), 0));
+#endif
 }
 
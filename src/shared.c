@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+#include <pthread.h>
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SHARED_LOCK()   pthread_mutex_lock(&shared_lock)
+#define SHARED_UNLOCK() pthread_mutex_unlock(&shared_lock)
+#else
+#define SHARED_LOCK()
+#define SHARED_UNLOCK()
+#endif
+
+typedef struct shared_entry {
+  char *name;
+  const mrb_polarssl_shared_kind *kind;
+  void *ptr;
+  size_t refs;
+  struct shared_entry *next;
+} shared_entry;
+
+static shared_entry *shared_head = NULL;
+
+#define SHARED_DEBUG_LEVELS 6  // mbedtls: 0 (nothing) to 5 (everything)
+static size_t shared_debug_vms[SHARED_DEBUG_LEVELS];  // VMs per threshold
+
+static shared_entry *shared_find(const char *name) {
+  shared_entry *e;
+
+  for (e = shared_head; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) return e;
+  }
+  return NULL;
+}
+
+int mrb_polarssl_shared_acquire(const char *name, const mrb_polarssl_shared_kind *kind,
+                                int (*create)(void *arg, void **ptr), void *arg, void **ptr) {
+  shared_entry *e;
+  void *obj = NULL;
+  int ret = 0;
+
+  SHARED_LOCK();
+  e = shared_find(name);
+  if (e != NULL) {
+    if (e->kind != kind) {
+      ret = MRB_POLARSSL_SHARED_WRONG_KIND;
+    } else {
+      e->refs++;
+      *ptr = e->ptr;
+    }
+    SHARED_UNLOCK();
+    return ret;
+  }
+
+  if (create == NULL) {
+    ret = MRB_POLARSSL_SHARED_MISSING;
+  } else if ((e = calloc(1, sizeof(shared_entry))) == NULL ||
+             (e->name = malloc(strlen(name) + 1)) == NULL) {
+    free(e);
+    ret = MRB_POLARSSL_SHARED_NO_MEMORY;
+  } else if ((ret = create(arg, &obj)) != 0) {
+    free(e->name);
+    free(e);
+  } else {
+    strcpy(e->name, name);
+    e->kind = kind;
+    e->ptr = obj;
+    e->refs = 1;
+    e->next = shared_head;
+    shared_head = e;
+    *ptr = obj;
+  }
+  SHARED_UNLOCK();
+  return ret;
+}
+
+int mrb_polarssl_shared_release(void *ptr) {
+  shared_entry **link, *dead = NULL;
+
+  if (ptr == NULL) return 0;
+  SHARED_LOCK();
+  for (link = &shared_head; *link != NULL; link = &(*link)->next) {
+    if ((*link)->ptr == ptr) break;
+  }
+  if (*link == NULL) {
+    SHARED_UNLOCK();
+    return 0;
+  }
+  if (--(*link)->refs == 0) {
+    dead = *link;
+    *link = dead->next;
+  }
+  SHARED_UNLOCK();
+
+  // outside the lock: destroy may free mbedtls state that takes its own locks
+  if (dead != NULL) {
+    dead->kind->destroy(dead->ptr);
+    free(dead->name);
+    free(dead);
+  }
+  return 1;
+}
+
+const mrb_polarssl_shared_kind *mrb_polarssl_shared_kind_of(const char *name) {
+  const mrb_polarssl_shared_kind *kind;
+  shared_entry *e;
+
+  SHARED_LOCK();
+  e = shared_find(name);
+  kind = e != NULL ? e->kind : NULL;
+  SHARED_UNLOCK();
+  return kind;
+}
+
+static int shared_debug_level(int threshold) {
+  if (threshold < 0) return 0;
+  if (threshold >= SHARED_DEBUG_LEVELS) return SHARED_DEBUG_LEVELS - 1;
+  return threshold;
+}
+
+int mrb_polarssl_shared_debug_threshold(int old_threshold, int threshold) {
+  int level, ret = 0;
+
+  SHARED_LOCK();
+  level = shared_debug_level(old_threshold);
+  if (level > 0 && shared_debug_vms[level] > 0)
+    shared_debug_vms[level]--;
+  level = shared_debug_level(threshold);
+  if (level > 0)
+    shared_debug_vms[level]++;
+  for (level = SHARED_DEBUG_LEVELS - 1; level > 0; level--) {
+    if (shared_debug_vms[level] > 0) {
+      ret = level;
+      break;
+    }
+  }
+  SHARED_UNLOCK();
+  return ret;
+}
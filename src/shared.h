@@ -0,0 +1,46 @@
+#ifndef MRUBY_POLARSSL_SHARED_H
+#define MRUBY_POLARSSL_SHARED_H
+
+/*
+ * Process wide registry of native objects used by several mrb_states at
+ * once (one VM per thread). The first VM asking for a name builds the
+ * object; every wrapper holds a reference and the last one destroys it.
+ * Sharing is only safe when mbedtls locks its contexts itself, so the Ruby
+ * side (PolarSSL::Shared) needs MBEDTLS_THREADING_C, see polarssl_threading
+ * in mrbgem.rake.
+ */
+
+#include "mbedtls/build_info.h"
+#include "worker_pool.h"
+
+#if defined(MBEDTLS_THREADING_C) && defined(MRUBY_POLARSSL_WORKER_POOL)
+#define MRUBY_POLARSSL_THREADING 1
+#endif
+
+// mbedtls error codes are negative, so these can't collide with them
+#define MRB_POLARSSL_SHARED_MISSING    1  // unknown name and no create function
+#define MRB_POLARSSL_SHARED_WRONG_KIND 2  // registered as another kind
+#define MRB_POLARSSL_SHARED_NO_MEMORY  3
+
+typedef struct mrb_polarssl_shared_kind {
+  const char *name;
+  void (*destroy)(void *ptr);
+} mrb_polarssl_shared_kind;
+
+// Takes a reference to the object registered as name. An unknown name is
+// built with create(arg, &ptr) while the registry is locked, so racing
+// VMs build it only once. Returns 0, MRB_POLARSSL_SHARED_* or create's
+// error code.
+int mrb_polarssl_shared_acquire(const char *name, const mrb_polarssl_shared_kind *kind,
+                                int (*create)(void *arg, void **ptr), void *arg, void **ptr);
+// Drops a reference. Returns 0 if ptr is not shared: the caller frees it.
+int mrb_polarssl_shared_release(void *ptr);
+// Kind registered as name, NULL for none.
+const mrb_polarssl_shared_kind *mrb_polarssl_shared_kind_of(const char *name);
+
+// mbedtls has one debug threshold per process: the highest level any VM
+// asked for, each VM filters the rest. A VM moves from old_threshold to
+// threshold (0 when it closes); returns the process wide level.
+int mrb_polarssl_shared_debug_threshold(int old_threshold, int threshold);
+
+#endif
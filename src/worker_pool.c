@@ -0,0 +1,135 @@
+#include "worker_pool.h"
+
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+
+#include <pthread.h>
+#include <unistd.h>
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static mrb_polarssl_task *pool_head = NULL;
+static mrb_polarssl_task *pool_tail = NULL;
+static int pool_size = 0;
+static int pool_started = 0;
+
+static int default_pool_size(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 2;
+}
+
+static void *pool_worker(void *unused) {
+  mrb_polarssl_task *task;
+  char byte = 1;
+
+  (void) unused;
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (pool_head == NULL)
+      pthread_cond_wait(&pool_work, &pool_lock);
+    task = pool_head;
+    pool_head = task->next;
+    if (pool_head == NULL) pool_tail = NULL;
+    task->next = NULL;
+    task->state = MRB_POLARSSL_TASK_RUNNING;
+    pthread_mutex_unlock(&pool_lock);
+
+    task->func(task->arg);
+
+    pthread_mutex_lock(&pool_lock);
+    task->state = MRB_POLARSSL_TASK_DONE;
+    if (task->notify_fd >= 0) {
+      if (write(task->notify_fd, &byte, 1) < 0) { /* reader gone, nothing to do */ }
+    }
+    pthread_cond_broadcast(&pool_done);
+  }
+  return NULL;
+}
+
+// must hold pool_lock
+static int pool_start(void) {
+  pthread_t thread;
+  int i;
+
+  if (pool_started) return 0;
+  if (pool_size <= 0) pool_size = default_pool_size();
+  for (i = 0; i < pool_size; i++) {
+    if (pthread_create(&thread, NULL, pool_worker, NULL) != 0) {
+      if (i == 0) return -1;
+      pool_size = i;
+      break;
+    }
+    pthread_detach(thread);
+  }
+  pool_started = 1;
+  return 0;
+}
+
+int mrb_polarssl_pool_set_size(int size) {
+  pthread_mutex_lock(&pool_lock);
+  if (!pool_started && size > 0)
+    pool_size = size;
+  size = pool_size > 0 ? pool_size : default_pool_size();
+  pthread_mutex_unlock(&pool_lock);
+  return size;
+}
+
+int mrb_polarssl_pool_size(void) {
+  return mrb_polarssl_pool_set_size(0);
+}
+
+int mrb_polarssl_pool_submit(mrb_polarssl_task *task) {
+  int rc;
+
+  pthread_mutex_lock(&pool_lock);
+  rc = pool_start();
+  if (rc == 0) {
+    task->state = MRB_POLARSSL_TASK_QUEUED;
+    task->next = NULL;
+    if (pool_tail) pool_tail->next = task;
+    else pool_head = task;
+    pool_tail = task;
+    pthread_cond_signal(&pool_work);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return rc;
+}
+
+enum mrb_polarssl_task_state mrb_polarssl_pool_state(mrb_polarssl_task *task) {
+  enum mrb_polarssl_task_state state;
+
+  pthread_mutex_lock(&pool_lock);
+  state = task->state;
+  pthread_mutex_unlock(&pool_lock);
+  return state;
+}
+
+void mrb_polarssl_pool_wait(mrb_polarssl_task *task) {
+  pthread_mutex_lock(&pool_lock);
+  while (task->state == MRB_POLARSSL_TASK_QUEUED || task->state == MRB_POLARSSL_TASK_RUNNING)
+    pthread_cond_wait(&pool_done, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int mrb_polarssl_pool_cancel(mrb_polarssl_task *task) {
+  mrb_polarssl_task **p, *prev = NULL;
+  int removed = 0;
+
+  pthread_mutex_lock(&pool_lock);
+  if (task->state == MRB_POLARSSL_TASK_QUEUED) {
+    for (p = &pool_head; *p; prev = *p, p = &(*p)->next) {
+      if (*p == task) {
+        *p = task->next;
+        if (pool_tail == task) pool_tail = prev;
+        task->next = NULL;
+        task->state = MRB_POLARSSL_TASK_IDLE;
+        removed = 1;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return removed;
+}
+
+#endif
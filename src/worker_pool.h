@@ -0,0 +1,40 @@
+#ifndef MRUBY_POLARSSL_WORKER_POOL_H
+#define MRUBY_POLARSSL_WORKER_POOL_H
+
+/*
+ * Process wide pool of native worker threads. Tasks must not touch any
+ * mrb_state: they run outside of the VM.
+ */
+
+#if !defined(_WIN32) && !defined(MRUBY_POLARSSL_NO_THREADS)
+#define MRUBY_POLARSSL_WORKER_POOL 1
+#endif
+
+enum mrb_polarssl_task_state {
+  MRB_POLARSSL_TASK_IDLE = 0,
+  MRB_POLARSSL_TASK_QUEUED,
+  MRB_POLARSSL_TASK_RUNNING,
+  MRB_POLARSSL_TASK_DONE
+};
+
+typedef struct mrb_polarssl_task {
+  void (*func)(void *arg);
+  void *arg;
+  int notify_fd;  // a byte is written here on completion, -1 for none
+  enum mrb_polarssl_task_state state;
+  struct mrb_polarssl_task *next;
+} mrb_polarssl_task;
+
+#ifdef MRUBY_POLARSSL_WORKER_POOL
+// Number of threads; only effective before the first task is submitted.
+int mrb_polarssl_pool_set_size(int size);
+int mrb_polarssl_pool_size(void);
+// Returns 0 on success, -1 if the pool could not be started.
+int mrb_polarssl_pool_submit(mrb_polarssl_task *task);
+enum mrb_polarssl_task_state mrb_polarssl_pool_state(mrb_polarssl_task *task);
+void mrb_polarssl_pool_wait(mrb_polarssl_task *task);
+// Removes a task that has not started yet. Returns 1 if it was removed.
+int mrb_polarssl_pool_cancel(mrb_polarssl_task *task);
+#endif
+
+#endif
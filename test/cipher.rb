@@ -63,6 +63,43 @@ class CipherTest < MTest::Unit::TestCase
     cipher.key = "0000000000000000FFFFFFFFFFFFFFFF"
     assert_equal "0000000000000000", cipher.update("9295B59BB384736E")
   end
+
+  def test_cipher_encrypt_aes_ecb
+    cipher = PolarSSL::Cipher.new("AES-ECB")
+    cipher.encrypt
+    cipher.key = "2b7e151628aed2a6abf7158809cf4f3c"
+    assert_equal "3AD77BB40D7A3660A89ECAF32466EF97", cipher.update("6bc1bee22e409f96e93d7e117393172a")
+  end
+
+  def test_cipher_encrypt_aes_ctr
+    cipher = PolarSSL::Cipher.new("AES-CTR")
+    cipher.encrypt
+    cipher.key = "2b7e151628aed2a6abf7158809cf4f3c"
+    cipher.iv  = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff"
+    assert_equal "874D6191B620E3261BEF6864990DB6CE", cipher.update("6bc1bee22e409f96e93d7e117393172a")
+  end
+
+  def test_cipher_encrypt_aes_gcm
+    cipher = PolarSSL::Cipher.new("AES-GCM")
+    cipher.encrypt
+    cipher.key = "00000000000000000000000000000000"
+    cipher.iv  = "000000000000000000000000"
+    # ciphertext followed by the tag
+    assert_equal "0388DACE60B6A392F328C2B971B2FE78AB6E47D42CEC13BDF53A67B21257BDDF",
+      cipher.update("00000000000000000000000000000000")
+  end
+
+  def test_cipher_decrypt_aes_gcm
+    cipher = PolarSSL::Cipher.new("AES-GCM")
+    cipher.decrypt
+    cipher.key = "00000000000000000000000000000000"
+    cipher.iv  = "000000000000000000000000"
+    assert_equal "00000000000000000000000000000000",
+      cipher.update("0388DACE60B6A392F328C2B971B2FE78AB6E47D42CEC13BDF53A67B21257BDDF")
+    assert_raise(PolarSSL::CipherError) do
+      cipher.update("0388DACE60B6A392F328C2B971B2FE78AB6E47D42CEC13BDF53A67B21257BDDE")
+    end
+  end
 end
 
 if $ok_test